@@ -6,9 +6,36 @@
 #endif
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <map>
+#include <climits>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 #include "cmdline.h"
 #include "ftd2xx.h"
 
@@ -24,16 +51,143 @@ struct XferConfig
 {
     int frequency;
     int real_freq;
-    unsigned char tx_buffer[8192];
-    unsigned char rx_buffer[8192];
+    std::vector <unsigned char> tx_buffer;
+    std::vector <unsigned char> gather_buffer;
+    std::vector <unsigned char> pending;
+    bool coalesce;
+    int chunk_size;
+    int lines;
+    int max_lines;
+    FT4222_SPICPOL cpol;
+    FT4222_SPICPHA cpha;
+    uint8 sso_map;
     FT4222_ClockRate sys_clk;
     FT4222_SPIClock clk_div;
 };
 
+//
+// adapter
+//
+// Every opened FT4222 is an Adapter, with its own handle, clock
+// configuration and buffers, and a Tcl command of its own (see
+// do_adapter_command). The plain commands work on CurrentAdapter, which is
+// the adapter opened last, or an unopened default one.
+//
+//
+// The SPI flash behind the adapter, found by its JEDEC ID and SFDP on
+// first use, see FlashProbe.
+//
+struct FlashEraseType
+{
+    uint32 size;
+    unsigned char opcode;
+    int typical_ms;
+    int max_ms;
+};
+
+// expected time of a program/erase: typical_us from SFDP, learned_us from
+// the completions seen, 0 if unknown
+struct FlashTiming
+{
+    int typical_us;
+    int learned_us;
+    int count;
+};
+
+struct FlashReadMode
+{
+    unsigned char opcode;
+    int dummy_clocks;
+    int mode_clocks;
+};
+
+enum FlashReadModeType
+{
+    FLASH_READ_AUTO,
+    FLASH_READ_NORMAL,
+    FLASH_READ_FAST,
+    FLASH_READ_DUAL,
+    FLASH_READ_DUAL_IO,
+    FLASH_READ_QUAD,
+    FLASH_READ_QUAD_IO
+};
+
+enum FlashEraseModeType
+{
+    FLASH_ERASE_NONE,
+    FLASH_ERASE_RANGE,
+    FLASH_ERASE_CHIP
+};
+
+enum FlashProgramModeType
+{
+    FLASH_PROGRAM_AUTO,
+    FLASH_PROGRAM_SINGLE,
+    FLASH_PROGRAM_QUAD
+};
+
+struct FlashReadCommand
+{
+    unsigned char opcode;
+    int address_lines;
+    int data_lines;
+    int dummy_clocks;
+    int mode_clocks;
+};
+
+struct FlashConfig
+{
+    bool probed;
+    uint32 jedec_id;
+    uint64 size;
+    int address_bytes;
+    bool four_byte_only;
+    bool sfdp;
+    uint32 page_size;
+    FlashEraseType erase_types[4];
+    FlashReadMode read_112;
+    FlashReadMode read_122;
+    FlashReadMode read_114;
+    FlashReadMode read_144;
+    int program_typical_us;
+    int program_max_us;
+    int chip_erase_typical_ms;
+    int chip_erase_max_ms;
+    int qe_requirement;
+    uint32 timing_id;
+    FlashTiming program_timing;
+    FlashTiming erase_timing[4];
+    FlashTiming chip_erase_timing;
+    bool unique_id_read;
+    std::string unique_id;
+    std::vector <unsigned char> buffer;
+};
+
+struct Worker;
+
+struct Adapter
+{
+    std::string name;
+    int index;
+    FT_HANDLE handle;
+    Tcl_Command token;
+    struct XferConfig config;
+    struct FlashConfig flash;
+    struct Worker *worker;
+    std::string error;
+    bool index_stale;
+};
+
 std::vector <FT_DEVICE_LIST_INFO_NODE> AdapterList;
-FT_HANDLE ftHandle;
-FT_STATUS ftStatus;
-struct XferConfig Config;
+std::vector <Adapter*> OpenAdapters;
+Adapter DefaultAdapter = Adapter();
+Adapter *CurrentAdapter = &DefaultAdapter;
+int AdapterCounter = 0;
+
+inline Adapter* GetAdapter(ClientData clientData)
+{
+    return (clientData!=NULL) ? (Adapter*)clientData : CurrentAdapter;
+}
 
 inline std::string DeviceFlagToString(DWORD flags)
 {
@@ -50,6 +204,7 @@ void DetectAdapters(void)
     FT_STATUS ftStatus = 0;
     DWORD numOfDevices = 0;
 
+    AdapterList.clear();
     ftStatus = FT_CreateDeviceInfoList(&numOfDevices);
     for(DWORD i=0; i<numOfDevices; ++i)
     {
@@ -100,1462 +255,7340 @@ void PrintAdapters(void)
 }
 
 //
-// tcl command 
+// read result
+//
+// The result byte array is allocated once at its final size, and LibFT4222
+// reads straight into its storage, no staging buffer and no zeroing.
+//
+// With -into <varName> [-offset <N>], the data is read in place into the
+// byte array held by the variable, which is only grown when the read goes
+// past its end, and the command returns the number of bytes read.
 //
+struct ReadTarget
+{
+    Tcl_Obj *varName;
+    int offset;
+};
 
-int do_adapter_list(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int ParseReadTarget(Tcl_Interp *interp, int *objc, Tcl_Obj *const objv[], ReadTarget *target)
 {
-    if (objc != 1)
+    std::string option;
+
+    target->varName = NULL;
+    target->offset = 0;
+
+    // options are trailing <-into varName> and <-offset N> pairs
+    while(*objc>=3)
     {
-        printf("Error: adapter_list accepts no parameter.\n");
-        return TCL_ERROR;
+        option = Tcl_GetString(objv[*objc-2]);
+        if(option=="-into")
+        {
+            target->varName = objv[*objc-1];
+        }
+        else if(option=="-offset")
+        {
+            if( (Tcl_GetIntFromObj(interp, objv[*objc-1], &target->offset)!=TCL_OK) || (target->offset<0) )
+            {
+                printf("Error: -offset should be a non negative int number.\n");
+                return TCL_ERROR;
+            }
+        }
+        else
+        {
+            break;
+        }
+        *objc -= 2;
     }
 
-    // detect
-    DetectAdapters();
-    if(AdapterList.size()==0)
+    if( (target->offset!=0) && (target->varName==NULL) )
     {
-        printf("Error: no adapter detect.\n");
+        printf("Error: -offset is only valid with -into <varName>.\n");
         return TCL_ERROR;
     }
 
-    PrintAdapters();
-
     return TCL_OK;
 }
 
-int do_adapter_open(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+// the buffer to read into, or NULL if -offset puts it beyond a byte array
+unsigned char* NewReadResult(Tcl_Interp *interp, ReadTarget *target, Tcl_Obj **resultObj, int length)
 {
-    DWORD locID;
-    int adapter_index;
+    Tcl_Obj *varObj;
+    unsigned char* array;
+    int array_length;
 
-    if (objc != 2)
+    if( (target==NULL) || (target->varName==NULL) )
     {
-        printf("Error: adapter_open <adapter_index>.\n");
-        return TCL_ERROR;
+        *resultObj = Tcl_NewObj();
+        Tcl_IncrRefCount(*resultObj);
+        return Tcl_SetByteArrayLength(*resultObj, length);
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &adapter_index) != TCL_OK)
+    // the byte array takes at most INT_MAX bytes
+    if( (long long)target->offset + length > INT_MAX )
     {
-        printf("Error: <adapter_index> should be a int number.\n");;
-        return TCL_ERROR;
+        printf("Error: -offset %d plus %d byte(s) is beyond the largest byte array.\n", target->offset, length);
+        return NULL;
     }
 
-    if( adapter_index>AdapterList.size()-1 )
+    varObj = Tcl_ObjGetVar2(interp, target->varName, NULL, 0);
+    if(varObj==NULL)
     {
-        printf("Error: adapter number %d, is beyond available range %ld, use --list or list_adapter to show available adapters.\n", adapter_index, AdapterList.size()-1);
-        return TCL_ERROR;
+        varObj = Tcl_NewObj();
+    }
+    else if(Tcl_IsShared(varObj))
+    {
+        varObj = Tcl_DuplicateObj(varObj);
     }
 
-    locID = AdapterList[adapter_index].LocId;
-    ftStatus = FT_OpenEx((PVOID)(uintptr_t)locID, FT_OPEN_BY_LOCATION, &ftHandle);
-    if(ftStatus!=FT_OK)
+    array = Tcl_GetByteArrayFromObj(varObj, &array_length);
+    if(target->offset+length > array_length)
     {
-        printf("Error: FT_OpenEX returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        array = Tcl_SetByteArrayLength(varObj, target->offset+length);
+        if(target->offset > array_length)
+        {
+            memset(array+array_length, 0, target->offset-array_length);
+        }
     }
+    Tcl_InvalidateStringRep(varObj);
 
-    debug("Info: adapter_open %d, done.\n", adapter_index);
+    *resultObj = varObj;
+    Tcl_IncrRefCount(*resultObj);
+    return array+target->offset;
+}
 
-    return TCL_OK;
+void FreeReadResult(Tcl_Obj *resultObj)
+{
+    Tcl_DecrRefCount(resultObj);
 }
 
-int do_adapter_close(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int SetReadResult(Tcl_Interp *interp, ReadTarget *target, Tcl_Obj *resultObj, int length)
 {
-    if (objc != 1)
+    if( (target==NULL) || (target->varName==NULL) )
     {
-        printf("Error: adapter_close accepts no parameter.\n");
-        return TCL_ERROR;
+        Tcl_SetObjResult(interp, resultObj);
+        Tcl_DecrRefCount(resultObj);
+        return TCL_OK;
     }
 
-    ftStatus = FT_Close(ftHandle);
-    if(ftStatus!=FT_OK)
+    if(Tcl_ObjSetVar2(interp, target->varName, NULL, resultObj, TCL_LEAVE_ERR_MSG)==NULL)
     {
-        printf("Error: FT_Close returns(%d), unknown error.\n", ftStatus);
+        Tcl_DecrRefCount(resultObj);
+        printf("Error: can not set variable %s.\n", Tcl_GetString(target->varName));
         return TCL_ERROR;
     }
-    else
-    {
-        debug("Info: adapter_close, done.\n");
-    }
+    Tcl_DecrRefCount(resultObj);
 
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(length));
     return TCL_OK;
 }
 
-int do_adapter_uninitialize(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+//
+// mapped file
+//
+// usbio::mmap maps an image file read-only and returns a value holding a
+// range of it, which any <write_buffer> takes straight from the mapping,
+// so a large image is never copied into the interpreter. The value is a
+// Tcl object of its own type, sharing the mapping with the ranges cut
+// from it, and gets a string of the bytes only if the script asks for
+// one, e.g. by string length. That string is then a copy.
+//
+struct MappedFile
 {
-    if (objc != 1)
-    {
-        printf("Error: adapter_uninitialize accepts no parameter.\n");
-        return TCL_ERROR;
-    }
+    unsigned char *base;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
 
-    ftStatus = FT4222_UnInitialize(ftHandle);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
-    {
-        printf("Error: FT4222_UnInitialize returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
-    }
-    else if(ftStatus!=FT_OK)
+    ~MappedFile()
     {
-        printf("Error: FT4222_UnInitialize returns(%d), unknown error.\n", ftStatus);
-    }
-    else
-    {
-        debug("Info: adapter_uninitialize, done.\n");
+#ifdef _WIN32
+        if(base!=NULL)
+        {
+            UnmapViewOfFile(base);
+        }
+        if(mapping!=NULL)
+        {
+            CloseHandle(mapping);
+        }
+        if(file!=INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+#else
+        if(base!=NULL)
+        {
+            munmap(base, size);
+        }
+#endif
     }
+};
 
-    return TCL_OK;
-}
-
-
-int do_adapter_frequency(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+struct MappedRange
 {
-    DWORD locID;
-    FT4222_ClockRate sys_clk;
-    FT4222_SPIClock clk_div;
-    int freq;
-    int real_freq;
+    std::shared_ptr <MappedFile> file;
+    size_t offset;
+    int length;
+};
 
-    if (objc != 2)
-    {
-        printf("Error: adapter_frequency <kHz>.\n");
-        return TCL_ERROR;
-    }
+void FreeMappedRange(Tcl_Obj *obj);
+void DupMappedRange(Tcl_Obj *src, Tcl_Obj *dup);
+void UpdateMappedRange(Tcl_Obj *obj);
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &freq) != TCL_OK)
-    {
-        printf("Error: <kHz> should be a int number.\n");;
-        return TCL_ERROR;
-    }
+const Tcl_ObjType MappedRangeType =
+{
+    "usbio_mmap", FreeMappedRange, DupMappedRange, UpdateMappedRange, NULL
+};
 
-    freq = freq*1000;
+void FreeMappedRange(Tcl_Obj *obj)
+{
+    delete (MappedRange*)obj->internalRep.twoPtrValue.ptr1;
+    obj->typePtr = NULL;
+}
 
-    // sck lookup table
-    //
-    //  sck         sys_clk     clk_div
-    //   46.875K    24MHz       div_512
-    //   93.75K     48MHz       div_512
-    //   117.18K    60MHz       div_512
-    //   156.25K    80MHz       div_512
-    //   187.5K     48MHz       div_256
-    //   234.375K   60MHz       div_256
-    //   312.5K     80MHz       div_256
-    //   375K       48MHz       div_128
-    //   468.75K    60MHz       div_128
-    //   625K       80MHz       div_128
-    //   750K       48MHz       div_64
-    //   937.5K     60MHz       div_64
-    //   1.25M      80MHz       div_64
-    //   1.5M       48MHz       div_32
-    //   1.875M     60MHz       div_32
-    //   2.5M       80MHz       div_32
-    //   3M         48MHz       div_16
-    //   3.75M      60MHz       div_16
-    //   5M         80MHz       div_16
-    //   6M         48MHz       div_8
-    //   7.5M       60MHz       div_8
-    //   10M        80MHz       div_8
-    //   12M        48MHz       div_4
-    //   15M        60MHz       div_4
-    //   20M        80MHz       div_16(errata suggest)
-    //   24M        48MHz       div_2
-    //   30M        60MHz       div_2
-    //   40M        80MHz       div_2
-    if     (freq<   93750) {sys_clk=SYS_CLK_24; clk_div=CLK_DIV_512; real_freq=   46875;}
-    else if(freq<  117180) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_512; real_freq=   93750;}
-    else if(freq<  156250) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_512; real_freq=  117180;}
-    else if(freq<  187500) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_512; real_freq=  156250;}
-    else if(freq<  234375) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_256; real_freq=  187500;}
-    else if(freq<  312500) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_256; real_freq=  234375;}
-    else if(freq<  375000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_256; real_freq=  312500;}
-    else if(freq<  468750) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_128; real_freq=  375000;}
-    else if(freq<  625000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_128; real_freq=  468750;}
-    else if(freq<  750000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_128; real_freq=  625000;}
-    else if(freq<  937500) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_64 ; real_freq=  750000;}
-    else if(freq< 1250000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_64 ; real_freq=  937500;}
-    else if(freq< 1500000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_64 ; real_freq= 1250000;}
-    else if(freq< 1875000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_32 ; real_freq= 1500000;}
-    else if(freq< 2500000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_32 ; real_freq= 1875000;}
-    else if(freq< 3000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_32 ; real_freq= 2500000;}
-    else if(freq< 3750000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_16 ; real_freq= 3000000;}
-    else if(freq< 5000000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_16 ; real_freq= 3750000;}
-    else if(freq< 6000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_16 ; real_freq= 5000000;}
-    else if(freq< 7500000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_8  ; real_freq= 6000000;}
-    else if(freq<10000000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_8  ; real_freq= 7500000;}
-    else if(freq<12000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_8  ; real_freq=10000000;}
-    else if(freq<15000000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_4  ; real_freq=12000000;}
-    else if(freq<20000000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_4  ; real_freq=15000000;}
-    else if(freq<24000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_16 ; real_freq=20000000;}
-    else if(freq<30000000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_2  ; real_freq=24000000;}
-    else if(freq<40000000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_2  ; real_freq=30000000;}
-    else                   {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_2  ; real_freq=40000000;}
+void DupMappedRange(Tcl_Obj *src, Tcl_Obj *dup)
+{
+    dup->internalRep.twoPtrValue.ptr1 = new MappedRange(*(MappedRange*)src->internalRep.twoPtrValue.ptr1);
+    dup->typePtr = &MappedRangeType;
+}
 
-    if(freq>=20000000 && freq<24000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_16 ; real_freq=5000000;}
+// the string of a byte array of the same bytes
+void UpdateMappedRange(Tcl_Obj *obj)
+{
+    MappedRange *range = (MappedRange*)obj->internalRep.twoPtrValue.ptr1;
+    Tcl_Obj *bytesObj = Tcl_NewByteArrayObj(range->file->base+range->offset, range->length);
+    const char *string;
+    int length;
 
-    Config.sys_clk = sys_clk;
-    Config.clk_div = clk_div;
-    Config.frequency = freq;
-    Config.real_freq = real_freq;
+    string = Tcl_GetStringFromObj(bytesObj, &length);
+    obj->bytes = (char*)ckalloc(length+1);
+    memcpy(obj->bytes, string, length+1);
+    obj->length = length;
+    Tcl_DecrRefCount(bytesObj);
+}
 
-    printf("Info: target frequency %.3fkHz, rounded to %.3fkHz.\n", (float)freq/1000, (float)real_freq/1000);
+Tcl_Obj* NewMappedRangeObj(const MappedRange &range)
+{
+    Tcl_Obj *obj = Tcl_NewObj();
 
-    return TCL_OK;
+    Tcl_InvalidateStringRep(obj);
+    obj->internalRep.twoPtrValue.ptr1 = new MappedRange(range);
+    obj->typePtr = &MappedRangeType;
+    return obj;
 }
 
+// the range of a value of usbio::mmap, or NULL
+MappedRange* GetMappedRange(Tcl_Obj *obj)
+{
+    return (obj->typePtr==&MappedRangeType) ? (MappedRange*)obj->internalRep.twoPtrValue.ptr1 : NULL;
+}
 
-int do_adapter_get_version(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+// the bytes of a write source, from the mapping or the byte array
+unsigned char* GetWriteBytes(Tcl_Obj *obj, int *length)
 {
-    FT4222_Version ver;
+    MappedRange *range = GetMappedRange(obj);
 
-    if (objc != 1)
-    {
-        printf("Error: adapter_get_version accepts no parameter.\n");
-        return TCL_ERROR;
-    }
+    static unsigned char empty;
 
-    ftStatus = FT4222_GetVersion(ftHandle, &ver);
-    if(ftStatus!=FT_OK)
+    if(range!=NULL)
     {
-        printf("Error: FT4222_GetVersion returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        *length = range->length;
+        return (range->length>0) ? range->file->base+range->offset : &empty;
     }
 
-    printf("Info: chip version 0x%08x, DLL version 0x%08x.\n", ver.chipVersion, ver.dllVersion);
-
-    return TCL_OK;
+    return Tcl_GetByteArrayFromObj(obj, length);
 }
 
-int do_adapter_chip_reset(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+std::shared_ptr <MappedFile> MapFile(const char *path, std::string *error)
 {
-    if (objc != 1)
-    {
-        printf("Error: adapter_chip_reset accepts no parameter.\n");
-        return TCL_ERROR;
-    }
+    std::shared_ptr <MappedFile> file(new MappedFile());
 
-    ftStatus = FT4222_ChipReset(ftHandle);
-    if(ftStatus==FT4222_DEVICE_NOT_SUPPORTED)
+    file->base = NULL;
+    file->size = 0;
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    file->mapping = NULL;
+    file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if( (file->file==INVALID_HANDLE_VALUE) || !GetFileSizeEx(file->file, &size) )
     {
-        printf("Error: FT4222_ChipReset returns(%d), FT4222_DEVICE_NOT_SUPPORTED.\n", ftStatus);
-        return TCL_ERROR;
+        *error = "can't open";
+        return NULL;
     }
-    else if(ftStatus!=FT_OK)
+    file->size = (size_t)size.QuadPart;
+    if(file->size!=0)
     {
-        printf("Error: FT4222_ChipReset returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        file->base = (file->mapping!=NULL) ? (unsigned char*)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
     }
+#else
+    struct stat st;
+    int fd;
 
-    debug("Info: adapter_chip_reset, done.\n");
-    return TCL_OK;
+    fd = open(path, O_RDONLY);
+    if( (fd<0) || (fstat(fd, &st)!=0) )
+    {
+        if(fd>=0)
+        {
+            close(fd);
+        }
+        *error = "can't open";
+        return NULL;
+    }
+    file->size = (size_t)st.st_size;
+    if(file->size!=0)
+    {
+        void *base = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+        file->base = (base!=MAP_FAILED) ? (unsigned char*)base : NULL;
+    }
+    close(fd);
+#endif
+
+    if( (file->size!=0) && (file->base==NULL) )
+    {
+        *error = "can't map";
+        return NULL;
+    }
+    if(file->size>0x7fffffff)
+    {
+        *error = "is 2GB or larger";
+        return NULL;
+    }
+
+    return file;
+}
+
+//
+// usbio::mmap open <file>
+// usbio::mmap range <mapped> <offset> [<length>]
+// usbio::mmap length <mapped>
+//
+// open returns the whole file, range a range of a mapped value, up to its
+// end if <length> is left out.
+//
+int do_mmap(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    std::string subcommand;
+    MappedRange range;
+    MappedRange *mapped;
+    Tcl_DString buffer;
+    std::string error;
+    const char *path;
+    int offset;
+    int length;
+
+    if (objc < 3)
+    {
+        printf("Error: usbio::mmap open|range|length [args].\n");
+        return TCL_ERROR;
+    }
+    subcommand = Tcl_GetString(objv[1]);
+
+    if (subcommand=="open")
+    {
+        if (objc != 3)
+        {
+            printf("Error: usbio::mmap open <file>.\n");
+            return TCL_ERROR;
+        }
+
+        path = Tcl_TranslateFileName(interp, Tcl_GetString(objv[2]), &buffer);
+        if (path == NULL)
+        {
+            printf("Error: usbio::mmap, bad file name %s.\n", Tcl_GetString(objv[2]));
+            return TCL_ERROR;
+        }
+        range.file = MapFile(path, &error);
+        Tcl_DStringFree(&buffer);
+        if (range.file == NULL)
+        {
+            printf("Error: usbio::mmap, %s %s.\n", Tcl_GetString(objv[2]), error.c_str());
+            return TCL_ERROR;
+        }
+
+        range.offset = 0;
+        range.length = (int)range.file->size;
+        debug("Info: usbio::mmap %s, %d byte(s) mapped.\n", Tcl_GetString(objv[2]), range.length);
+        Tcl_SetObjResult(interp, NewMappedRangeObj(range));
+        return TCL_OK;
+    }
+
+    mapped = GetMappedRange(objv[2]);
+    if (mapped == NULL)
+    {
+        printf("Error: usbio::mmap %s, <mapped> should be a value of usbio::mmap open or range.\n", subcommand.c_str());
+        return TCL_ERROR;
+    }
+
+    if (subcommand=="length")
+    {
+        if (objc != 3)
+        {
+            printf("Error: usbio::mmap length <mapped>.\n");
+            return TCL_ERROR;
+        }
+
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(mapped->length));
+        return TCL_OK;
+    }
+
+    if (subcommand=="range")
+    {
+        if ( (objc < 4) || (objc > 5) )
+        {
+            printf("Error: usbio::mmap range <mapped> <offset> [<length>].\n");
+            return TCL_ERROR;
+        }
+
+        if ( (Tcl_GetIntFromObj(interp, objv[3], &offset) != TCL_OK) || (offset < 0) || (offset > mapped->length) )
+        {
+            printf("Error: <offset> should be 0~%d.\n", mapped->length);
+            return TCL_ERROR;
+        }
+
+        length = mapped->length - offset;
+        if ( (objc == 5) && ((Tcl_GetIntFromObj(interp, objv[4], &length) != TCL_OK) || (length < 0) || (length > mapped->length - offset)) )
+        {
+            printf("Error: <length> should be 0~%d.\n", mapped->length - offset);
+            return TCL_ERROR;
+        }
+
+        range.file = mapped->file;
+        range.offset = mapped->offset + offset;
+        range.length = length;
+        Tcl_SetObjResult(interp, NewMappedRangeObj(range));
+        return TCL_OK;
+    }
+
+    printf("Error: usbio::mmap, unknown subcommand %s.\n", subcommand.c_str());
+    return TCL_ERROR;
+}
+
+//
+// write buffer
+//
+// A <write_buffer> is a byte array, a value of usbio::mmap, or a value of
+// usbio::gather, which holds the buffers given to it, and is gathered into
+// <gather> in one pass, so scripts don't need to append them into a new
+// string first. A value of usbio::gather is the bytes of its buffers one
+// after another, and gets a string of them only if the script asks for
+// one, so it means the same bytes whatever is done with it. A plain Tcl
+// list is never taken apart, it's sent as the bytes of its string.
+//
+void FreeGather(Tcl_Obj *obj);
+void DupGather(Tcl_Obj *src, Tcl_Obj *dup);
+void UpdateGather(Tcl_Obj *obj);
+
+const Tcl_ObjType GatherType =
+{
+    "usbio_gather", FreeGather, DupGather, UpdateGather, NULL
+};
+
+void FreeGather(Tcl_Obj *obj)
+{
+    std::vector <Tcl_Obj*> *parts = (std::vector <Tcl_Obj*>*)obj->internalRep.twoPtrValue.ptr1;
+    size_t i;
+
+    for(i=0; i<parts->size(); i++)
+    {
+        Tcl_DecrRefCount((*parts)[i]);
+    }
+    delete parts;
+    obj->typePtr = NULL;
+}
+
+void DupGather(Tcl_Obj *src, Tcl_Obj *dup)
+{
+    std::vector <Tcl_Obj*> *parts = new std::vector <Tcl_Obj*>(*(std::vector <Tcl_Obj*>*)src->internalRep.twoPtrValue.ptr1);
+    size_t i;
+
+    for(i=0; i<parts->size(); i++)
+    {
+        Tcl_IncrRefCount((*parts)[i]);
+    }
+    dup->internalRep.twoPtrValue.ptr1 = parts;
+    dup->typePtr = &GatherType;
+}
+
+// the string of a byte array of the bytes of the parts
+void UpdateGather(Tcl_Obj *obj)
+{
+    std::vector <Tcl_Obj*> *parts = (std::vector <Tcl_Obj*>*)obj->internalRep.twoPtrValue.ptr1;
+    Tcl_Obj *bytesObj = Tcl_NewByteArrayObj(NULL, 0);
+    unsigned char *bytes;
+    const char *string;
+    int length;
+    int total = 0;
+    size_t i;
+
+    for(i=0; i<parts->size(); i++)
+    {
+        GetWriteBytes((*parts)[i], &length);
+        total += length;
+    }
+    Tcl_SetByteArrayLength(bytesObj, total);
+    total = 0;
+    for(i=0; i<parts->size(); i++)
+    {
+        bytes = GetWriteBytes((*parts)[i], &length);
+        memcpy(Tcl_GetByteArrayFromObj(bytesObj, NULL)+total, bytes, length);
+        total += length;
+    }
+
+    string = Tcl_GetStringFromObj(bytesObj, &length);
+    obj->bytes = (char*)ckalloc(length+1);
+    memcpy(obj->bytes, string, length+1);
+    obj->length = length;
+    Tcl_DecrRefCount(bytesObj);
+}
+
+// a value of the parts, which are held until it's freed
+Tcl_Obj* NewGatherObj(const std::vector <Tcl_Obj*> &parts)
+{
+    Tcl_Obj *obj = Tcl_NewObj();
+    size_t i;
+
+    for(i=0; i<parts.size(); i++)
+    {
+        Tcl_IncrRefCount(parts[i]);
+    }
+    Tcl_InvalidateStringRep(obj);
+    obj->internalRep.twoPtrValue.ptr1 = new std::vector <Tcl_Obj*>(parts);
+    obj->typePtr = &GatherType;
+    return obj;
+}
+
+// the parts of a value of usbio::gather, or NULL
+std::vector <Tcl_Obj*>* GetGatherParts(Tcl_Obj *obj)
+{
+    return (obj->typePtr==&GatherType) ? (std::vector <Tcl_Obj*>*)obj->internalRep.twoPtrValue.ptr1 : NULL;
+}
+
+//
+// usbio::gather <write_buffer> ...
+//
+// returns a value of the buffers one after another, for any <write_buffer>
+//
+int do_gather(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    std::vector <Tcl_Obj*> parts;
+    std::vector <Tcl_Obj*> *inner;
+    int i;
+
+    // a value of usbio::gather given to it is taken apart, so it's flat
+    for(i=1; i<objc; i++)
+    {
+        inner = GetGatherParts(objv[i]);
+        if(inner!=NULL)
+        {
+            parts.insert(parts.end(), inner->begin(), inner->end());
+        }
+        else
+        {
+            parts.push_back(objv[i]);
+        }
+    }
+
+    Tcl_SetObjResult(interp, NewGatherObj(parts));
+    return TCL_OK;
+}
+
+unsigned char* GetWriteBuffer(Tcl_Obj *obj, int *array_length, std::vector <unsigned char> &gather)
+{
+    std::vector <Tcl_Obj*> *parts = GetGatherParts(obj);
+    int i;
+    int count;
+    int length;
+    int total;
+    unsigned char* array;
+
+    if(parts==NULL)
+    {
+        return GetWriteBytes(obj, array_length);
+    }
+
+    count = (int)parts->size();
+    if(count==1)
+    {
+        return GetWriteBytes((*parts)[0], array_length);
+    }
+
+    total = 0;
+    for(i=0; i<count; i++)
+    {
+        GetWriteBytes((*parts)[i], &length);
+        total += length;
+    }
+
+    gather.resize(total);
+    total = 0;
+    for(i=0; i<count; i++)
+    {
+        array = GetWriteBytes((*parts)[i], &length);
+        if(length>0)
+        {
+            memcpy(&gather[total], array, length);
+        }
+        total += length;
+    }
+    debug("Debug: %d byte(s) gathered from %d buffer(s)\n", total, count);
+
+    *array_length = total;
+    return gather.empty() ? NULL : &gather[0];
+}
+
+//
+// write data
+//
+// The write buffer is passed to LibFT4222 as is. Only when <length> is longer
+// than the buffer, the data is staged in tx_buffer and zero padded, as the
+// previous fixed size tx_buffer did.
+//
+unsigned char* GetWriteData(Adapter *adapter, unsigned char *array, int array_length, int length)
+{
+    if(length<=array_length)
+    {
+        return array;
+    }
+
+    adapter->config.tx_buffer.assign(length, 0x0);
+    if(array_length>0)
+    {
+        memcpy(&adapter->config.tx_buffer[0], array, array_length);
+    }
+    return &adapter->config.tx_buffer[0];
+}
+
+//
+// chunked transfer
+//
+// LibFT4222 takes uint16 sizes. Longer transfers are split at the largest
+// multiple of FT4222_GetMaxTransferSize that fits in uint16, so every call
+// but the last one fills whole USB packets. For SPI, CS is kept asserted
+// between chunks. For I2C, START goes with the first chunk and STOP with
+// the last one.
+//
+int GetChunkSize(Adapter *adapter)
+{
+    FT_STATUS ftStatus;
+    uint16 maxSize;
+
+    if(adapter->config.chunk_size==0)
+    {
+        maxSize = 0;
+        ftStatus = FT4222_GetMaxTransferSize(adapter->handle, &maxSize);
+        if( (ftStatus!=FT_OK) || (maxSize==0) )
+        {
+            return 0xFFFF;
+        }
+        adapter->config.chunk_size = (0xFFFF/maxSize)*maxSize;
+        debug("Debug: max transfer size %d, chunk size %d\n", maxSize, adapter->config.chunk_size);
+    }
+
+    return adapter->config.chunk_size;
+}
+
+FT_STATUS SPIMaster_SingleWrite(Adapter *adapter, unsigned char *buffer, int length, int *sizeTransferred, bool isEndTransaction)
+{
+    FT_STATUS status;
+    int chunk = GetChunkSize(adapter);
+    int offset = 0;
+    uint16 size;
+    uint16 transferred;
+    bool last;
+
+    do
+    {
+        size = (uint16)std::min(chunk, length-offset);
+        last = (offset+size==length);
+        transferred = 0;
+        status = FT4222_SPIMaster_SingleWrite(adapter->handle, buffer+offset, size, &transferred, last?isEndTransaction:false);
+        offset += transferred;
+    } while( (status==FT_OK) && (transferred==size) && !last );
+
+    *sizeTransferred = offset;
+    return status;
+}
+
+FT_STATUS SPIMaster_SingleRead(Adapter *adapter, unsigned char *buffer, int length, int *sizeTransferred, bool isEndTransaction)
+{
+    FT_STATUS status;
+    int chunk = GetChunkSize(adapter);
+    int offset = 0;
+    uint16 size;
+    uint16 transferred;
+    bool last;
+
+    do
+    {
+        size = (uint16)std::min(chunk, length-offset);
+        last = (offset+size==length);
+        transferred = 0;
+        status = FT4222_SPIMaster_SingleRead(adapter->handle, buffer+offset, size, &transferred, last?isEndTransaction:false);
+        offset += transferred;
+    } while( (status==FT_OK) && (transferred==size) && !last );
+
+    *sizeTransferred = offset;
+    return status;
+}
+
+FT_STATUS SPIMaster_SingleReadWrite(Adapter *adapter, unsigned char *readBuffer, unsigned char *writeBuffer, int length, int *sizeTransferred, bool isEndTransaction)
+{
+    FT_STATUS status;
+    int chunk = GetChunkSize(adapter);
+    int offset = 0;
+    uint16 size;
+    uint16 transferred;
+    bool last;
+
+    do
+    {
+        size = (uint16)std::min(chunk, length-offset);
+        last = (offset+size==length);
+        transferred = 0;
+        status = FT4222_SPIMaster_SingleReadWrite(adapter->handle, readBuffer+offset, writeBuffer+offset, size, &transferred, last?isEndTransaction:false);
+        offset += transferred;
+    } while( (status==FT_OK) && (transferred==size) && !last );
+
+    *sizeTransferred = offset;
+    return status;
+}
+
+const char* FT4222StatusString(FT_STATUS status)
+{
+    switch(status)
+    {
+        case FT4222_DEVICE_NOT_OPENED       : return "FT4222_DEVICE_NOT_OPENED";
+        case FT4222_DEVICE_NOT_SUPPORTED    : return "FT4222_DEVICE_NOT_SUPPORTED";
+        case FT4222_INVALID_PARAMETER       : return "FT4222_INVALID_PARAMETER";
+        case FT4222_INVALID_POINTER         : return "FT4222_INVALID_POINTER";
+        case FT4222_IS_NOT_SPI_MODE         : return "FT4222_IS_NOT_SPI_MODE";
+        case FT4222_IS_NOT_SPI_SINGLE_MODE  : return "FT4222_IS_NOT_SPI_SINGLE_MODE";
+        case FT4222_IS_NOT_SPI_MULTI_MODE   : return "FT4222_IS_NOT_SPI_MULTI_MODE";
+        case FT4222_IS_NOT_I2C_MODE         : return "FT4222_IS_NOT_I2C_MODE";
+        case FT4222_NOT_SUPPORTED           : return "FT4222_NOT_SUPPORTED";
+        case FT4222_FAILED_TO_WRITE_DEVICE  : return "FT4222_FAILED_TO_WRITE_DEVICE";
+        case FT4222_FAILED_TO_READ_DEVICE   : return "FT4222_FAILED_TO_READ_DEVICE";
+        default                             : return "unknown error";
+    }
+}
+
+// split an I2C flag into the part for the first and the last chunk
+uint8 I2CChunkFlag(uint8 flag, bool first, bool last)
+{
+    uint8 chunk_flag = 0;
+
+    if(first) chunk_flag |= (flag & 0x03);
+    if(last)  chunk_flag |= (flag & 0x04);
+
+    return (chunk_flag==0) ? 0x80 : chunk_flag;
+}
+
+FT_STATUS I2CMaster_ReadEx(Adapter *adapter, uint16 slave, uint8 flag, unsigned char *buffer, int length, int *sizeTransferred)
+{
+    FT_STATUS status;
+    int chunk = GetChunkSize(adapter);
+    int offset = 0;
+    uint16 size;
+    uint16 transferred;
+    bool last;
+
+    do
+    {
+        size = (uint16)std::min(chunk, length-offset);
+        last = (offset+size==length);
+        transferred = 0;
+        status = FT4222_I2CMaster_ReadEx(adapter->handle, slave, I2CChunkFlag(flag, offset==0, last), buffer+offset, size, &transferred);
+        offset += transferred;
+    } while( (status==FT_OK) && (transferred==size) && !last );
+
+    *sizeTransferred = offset;
+    return status;
+}
+
+FT_STATUS I2CMaster_WriteEx(Adapter *adapter, uint16 slave, uint8 flag, unsigned char *buffer, int length, int *sizeTransferred)
+{
+    FT_STATUS status;
+    int chunk = GetChunkSize(adapter);
+    int offset = 0;
+    uint16 size;
+    uint16 transferred;
+    bool last;
+
+    do
+    {
+        size = (uint16)std::min(chunk, length-offset);
+        last = (offset+size==length);
+        transferred = 0;
+        status = FT4222_I2CMaster_WriteEx(adapter->handle, slave, I2CChunkFlag(flag, offset==0, last), buffer+offset, size, &transferred);
+        offset += transferred;
+    } while( (status==FT_OK) && (transferred==size) && !last );
+
+    *sizeTransferred = offset;
+    return status;
+}
+
+FT_STATUS I2CMaster_Read(Adapter *adapter, uint16 slave, unsigned char *buffer, int length, int *sizeTransferred)
+{
+    FT_STATUS status;
+    uint16 transferred = 0;
+
+    if(length>GetChunkSize(adapter))
+    {
+        return I2CMaster_ReadEx(adapter, slave, START_AND_STOP, buffer, length, sizeTransferred);
+    }
+
+    status = FT4222_I2CMaster_Read(adapter->handle, slave, buffer, (uint16)length, &transferred);
+    *sizeTransferred = transferred;
+    return status;
+}
+
+FT_STATUS I2CMaster_Write(Adapter *adapter, uint16 slave, unsigned char *buffer, int length, int *sizeTransferred)
+{
+    FT_STATUS status;
+    uint16 transferred = 0;
+
+    if(length>GetChunkSize(adapter))
+    {
+        return I2CMaster_WriteEx(adapter, slave, START_AND_STOP, buffer, length, sizeTransferred);
+    }
+
+    status = FT4222_I2CMaster_Write(adapter->handle, slave, buffer, (uint16)length, &transferred);
+    *sizeTransferred = transferred;
+    return status;
+}
+
+//
+// write coalescing
+//
+// With spi_master_coalesce on, cs_keep writes are appended to adapter->config.pending
+// on the host instead of being sent. The next SPI command sends them as one
+// transfer with CS still asserted, so the bus sees the same bytes in the
+// same CS window. A write that releases CS is sent together with them.
+//
+int FlushPendingWrite(Adapter *adapter)
+{
+    FT_STATUS ftStatus;
+    int length;
+    int sizeTransferred;
+
+    if(adapter->config.pending.empty())
+    {
+        return TCL_OK;
+    }
+
+    length = (int)adapter->config.pending.size();
+    ftStatus = SPIMaster_SingleWrite(adapter, &adapter->config.pending[0], length, &sizeTransferred, false);
+    adapter->config.pending.clear();
+
+    if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), %s.\n", ftStatus, FT4222StatusString(ftStatus));
+        return TCL_ERROR;
+    }
+
+    if(sizeTransferred != length)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
+        return TCL_ERROR;
+    }
+
+    debug("Debug: %d coalesced byte(s) flushed.\n", length);
+    return TCL_OK;
+}
+
+//
+// spi flash
+//
+// SPI NOR flash operations done in C++, used by the flash command and
+// gang_program. The flash is probed by its JEDEC ID on first use, and its
+// page size, erase types and address width are taken from SFDP, or 256-byte
+// page and 4KB sector erase if it has none. Flash larger than 16MB is
+// accessed with the 4-byte address commands, e.g. 0x13/0x12/0x21 instead
+// of 0x03/0x02/0x20.
+// Reads use the fastest dual/quad read the flash supports, see
+// FlashGetReadCommand, and page program sends the data on four lines
+// with 0x32 when asked, see FlashProgramMode. The lines of the FT4222 are switched as
+// needed, the other commands are sent on a single line.
+// On error, the message is printed and also kept in adapter->error.
+//
+#define FLASH_PAGE_SIZE           256
+#define FLASH_3BYTE_SIZE          0x1000000
+#define FLASH_SECTOR_SIZE         4096
+#define FLASH_VERIFY_SIZE         65536
+#define FLASH_PROGRAM_TIMEOUT     100
+#define FLASH_ERASE_TIMEOUT       3000
+#define FLASH_CHIP_ERASE_TIMEOUT  400000
+#define FLASH_MULTI_READ_SIZE     0xff00
+#define FLASH_POLL_MAX_US         2000
+#define FLASH_DUMP_CHUNK          0x40000
+#define FLASH_DUMP_SLOTS          8
+#define FLASH_PREFETCH_CHUNK      0x10000
+#define FLASH_PREFETCH_SLOTS      4
+#define FLASH_HASH_SEED           0xcbf29ce484222325ULL
+#ifdef _WIN32
+#define FLASH_SLEEP_MIN_US        16000
+#else
+#define FLASH_SLEEP_MIN_US        200
+#endif
+
+int FlashError(Adapter *adapter, const char *format, ...)
+{
+    char message[256];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    adapter->error = message;
+    printf("Error: %s, %s.\n", adapter->name.c_str(), message);
+    return TCL_ERROR;
+}
+
+// switch the FT4222 to single, dual or quad lines
+int FlashSetLines(Adapter *adapter, int lines)
+{
+    FT_STATUS ftStatus;
+
+    // lines not set by spi_master_init, it's up to the script
+    if( (adapter->config.lines==lines) || ((adapter->config.lines==0) && (lines==1)) )
+    {
+        return TCL_OK;
+    }
+
+    adapter->config.chunk_size = 0;
+    ftStatus = FT4222_SPIMaster_SetLines(adapter->handle, (lines==4) ? SPI_IO_QUAD : (lines==2) ? SPI_IO_DUAL : SPI_IO_SINGLE);
+    if(ftStatus!=FT_OK)
+    {
+        return FlashError(adapter, "FT4222_SPIMaster_SetLines %d returns(%d), %s", lines, ftStatus, FT4222StatusString(ftStatus));
+    }
+
+    adapter->config.lines = lines;
+    return TCL_OK;
+}
+
+// write tx, then read rx, in one CS window
+int FlashTransfer(Adapter *adapter, unsigned char *tx, int tx_length, unsigned char *rx, int rx_length)
+{
+    FT_STATUS ftStatus;
+    int sizeTransferred;
+
+    // a command without data is sent in the single line phase of a
+    // multi-line transfer, saving a switch of lines
+    if( (adapter->config.lines>1) && (rx_length==0) && (tx_length<=0xff) )
+    {
+        uint32 sizeOfRead;
+        unsigned char rx_dummy;
+
+        ftStatus = FT4222_SPIMaster_MultiReadWrite(adapter->handle, &rx_dummy, tx, (uint8)tx_length, 0, 0, &sizeOfRead);
+        if(ftStatus!=FT_OK)
+        {
+            return FlashError(adapter, "flash command 0x%02x returns(%d), %s", tx[0], ftStatus, FT4222StatusString(ftStatus));
+        }
+        return TCL_OK;
+    }
+
+    if(FlashSetLines(adapter, 1)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = SPIMaster_SingleWrite(adapter, tx, tx_length, &sizeTransferred, rx_length==0);
+    if( (ftStatus==FT_OK) && (sizeTransferred==tx_length) && (rx_length>0) )
+    {
+        ftStatus = SPIMaster_SingleRead(adapter, rx, rx_length, &sizeTransferred, true);
+        tx_length = rx_length;
+    }
+
+    if(ftStatus!=FT_OK)
+    {
+        return FlashError(adapter, "flash command 0x%02x returns(%d), %s", tx[0], ftStatus, FT4222StatusString(ftStatus));
+    }
+
+    if(sizeTransferred!=tx_length)
+    {
+        return FlashError(adapter, "flash command 0x%02x transfers %d of %d byte(s)", tx[0], sizeTransferred, tx_length);
+    }
+
+    return TCL_OK;
+}
+
+//
+// sfdp
+//
+// The Basic Flash Parameter Table of JESD216 is read once per JEDEC ID,
+// and cached in <cache dir>/sfdp-<jedec_id>.txt, see CachePath. Later
+// sessions take the parameters from there with no extra bus reads.
+//
+std::mutex CacheLock;
+
+// $USBIO_CACHE, or .usbio in the home directory, created if needed
+std::string CachePath(const std::string &name)
+{
+    const char *dir;
+    std::string path;
+    Tcl_Obj *pathObj;
+
+    if( ((dir=getenv("USBIO_CACHE"))!=NULL) && (dir[0]!='\0') )
+    {
+        path = dir;
+    }
+    else if( (((dir=getenv("HOME"))!=NULL) || ((dir=getenv("USERPROFILE"))!=NULL)) && (dir[0]!='\0') )
+    {
+        path = std::string(dir) + "/.usbio";
+    }
+    else
+    {
+        return "";
+    }
+
+    pathObj = Tcl_NewStringObj(path.c_str(), -1);
+    Tcl_IncrRefCount(pathObj);
+    if(Tcl_FSAccess(pathObj, 0)!=0)
+    {
+        Tcl_FSCreateDirectory(pathObj);
+    }
+    Tcl_DecrRefCount(pathObj);
+
+    return path + "/" + name;
+}
+
+void FlashDefaults(FlashConfig *flash, uint32 jedec_id)
+{
+    unsigned char capacity = jedec_id & 0xff;
+
+    flash->jedec_id = jedec_id;
+    flash->size = ( (capacity>=0x10) && (capacity<=0x21) ) ? ((uint64)1<<capacity) : 0;
+    flash->sfdp = false;
+    flash->address_bytes = 3;
+    flash->four_byte_only = false;
+    flash->page_size = FLASH_PAGE_SIZE;
+    memset(flash->erase_types, 0, sizeof(flash->erase_types));
+    flash->erase_types[0].size = FLASH_SECTOR_SIZE;
+    flash->erase_types[0].opcode = 0x20;
+    flash->erase_types[0].max_ms = FLASH_ERASE_TIMEOUT;
+    memset(&flash->read_112, 0, sizeof(flash->read_112));
+    memset(&flash->read_122, 0, sizeof(flash->read_122));
+    memset(&flash->read_114, 0, sizeof(flash->read_114));
+    memset(&flash->read_144, 0, sizeof(flash->read_144));
+    flash->program_typical_us = 0;
+    flash->program_max_us = FLASH_PROGRAM_TIMEOUT*1000;
+    flash->chip_erase_typical_ms = 0;
+    flash->chip_erase_max_ms = FLASH_CHIP_ERASE_TIMEOUT;
+    flash->qe_requirement = 0;
+}
+
+int FlashReadSfdp(Adapter *adapter, uint32 address, unsigned char *buffer, int length)
+{
+    unsigned char tx[5] = { 0x5a, (unsigned char)(address>>16), (unsigned char)(address>>8), (unsigned char)address, 0x00 };
+
+    return FlashTransfer(adapter, tx, 5, buffer, length);
+}
+
+bool IsPowerOf2(uint64 value, uint64 min, uint64 max)
+{
+    return (value>=min) && (value<=max) && ((value & (value-1))==0);
+}
+
+// The parameters are used in % and mask arithmetic, so a page size that is
+// not a power of 2 from 1 to 4096, an erase size that is not one from 2^8
+// to 2^26, or a size beyond 4-byte address is taken as a misread table.
+bool FlashCheckConfig(const FlashConfig *flash)
+{
+    int i;
+
+    if( !IsPowerOf2(flash->page_size, 1, 4096) || (flash->size>((uint64)1<<32)) )
+    {
+        return false;
+    }
+
+    for(i=0; i<4; i++)
+    {
+        if( (flash->erase_types[i].size!=0) && !IsPowerOf2(flash->erase_types[i].size, (uint64)1<<8, (uint64)1<<26) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// returns TCL_OK with flash->sfdp false if the flash has no SFDP, or if
+// the table fails FlashCheckConfig, then the flash has the defaults and
+// valid is false, so it's not cached
+int FlashParseSfdp(Adapter *adapter, FlashConfig *flash, bool *valid)
+{
+    static const int erase_units[4] = { 1, 16, 128, 1000 };
+    static const int chip_erase_units[4] = { 16, 256, 4000, 64000 };
+    unsigned char header[8];
+    unsigned char headers[8*8];
+    unsigned char table[20*4];
+    uint32 dw[21];
+    int headers_count;
+    int dwords = 0;
+    uint32 pointer = 0;
+    int multiplier;
+    int i;
+
+    *valid = true;
+    if(FlashReadSfdp(adapter, 0, header, 8)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    if(memcmp(header, "SFDP", 4)!=0)
+    {
+        debug("Info: %s, flash has no SFDP.\n", adapter->name.c_str());
+        return TCL_OK;
+    }
+
+    headers_count = std::min(header[6]+1, 8);
+    if(FlashReadSfdp(adapter, 8, headers, 8*headers_count)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    // the basic flash parameter table, ID 0xff00
+    for(i=0; i<headers_count; i++)
+    {
+        if( (headers[8*i]==0x00) && (headers[8*i+7]==0xff) )
+        {
+            dwords = std::min((int)headers[8*i+3], 20);
+            pointer = headers[8*i+4] | (headers[8*i+5]<<8) | (headers[8*i+6]<<16);
+            break;
+        }
+    }
+
+    if(dwords<9)
+    {
+        debug("Info: %s, flash has no basic flash parameter table.\n", adapter->name.c_str());
+        return TCL_OK;
+    }
+
+    if(FlashReadSfdp(adapter, pointer, table, 4*dwords)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    memset(dw, 0, sizeof(dw));
+    for(i=0; i<dwords; i++)
+    {
+        dw[i+1] = table[4*i] | (table[4*i+1]<<8) | (table[4*i+2]<<16) | ((uint32)table[4*i+3]<<24);
+    }
+
+    flash->sfdp = true;
+    flash->four_byte_only = ((dw[1]>>17) & 0x3)==2;
+    flash->size = (dw[2] & 0x80000000) ? ( ((dw[2] & 0x7fffffff)<=35) ? (((uint64)1<<(dw[2] & 0x7fffffff))/8) : ~(uint64)0 ) : (((uint64)dw[2]+1)/8);
+
+    if(dw[1] & (1<<16))
+    {
+        flash->read_112.opcode = (dw[4]>>8) & 0xff;
+        flash->read_112.dummy_clocks = dw[4] & 0x1f;
+        flash->read_112.mode_clocks = (dw[4]>>5) & 0x7;
+    }
+    if(dw[1] & (1<<20))
+    {
+        flash->read_122.opcode = (dw[4]>>24) & 0xff;
+        flash->read_122.dummy_clocks = (dw[4]>>16) & 0x1f;
+        flash->read_122.mode_clocks = (dw[4]>>21) & 0x7;
+    }
+    if(dw[1] & (1<<22))
+    {
+        flash->read_114.opcode = (dw[3]>>24) & 0xff;
+        flash->read_114.dummy_clocks = (dw[3]>>16) & 0x1f;
+        flash->read_114.mode_clocks = (dw[3]>>21) & 0x7;
+    }
+    if(dw[1] & (1<<21))
+    {
+        flash->read_144.opcode = (dw[3]>>8) & 0xff;
+        flash->read_144.dummy_clocks = dw[3] & 0x1f;
+        flash->read_144.mode_clocks = (dw[3]>>5) & 0x7;
+    }
+
+    // erase types 1~4, size is 2^N, 0 if not supported
+    memset(flash->erase_types, 0, sizeof(flash->erase_types));
+    for(i=0; i<4; i++)
+    {
+        uint32 type = (dw[8+i/2] >> (16*(i%2))) & 0xffff;
+        if( (type & 0xff)!=0 )
+        {
+            // 1 is not a valid erase size, so it fails the check
+            flash->erase_types[i].size = ((type & 0xff)<=26) ? (1 << (type & 0xff)) : 1;
+            flash->erase_types[i].opcode = type >> 8;
+            flash->erase_types[i].max_ms = FLASH_ERASE_TIMEOUT;
+        }
+    }
+    if( (flash->erase_types[0].size==0) && ((dw[1] & 0x3)==0x1) )
+    {
+        flash->erase_types[0].size = FLASH_SECTOR_SIZE;
+        flash->erase_types[0].opcode = (dw[1]>>8) & 0xff;
+        flash->erase_types[0].max_ms = FLASH_ERASE_TIMEOUT;
+    }
+
+    // timing and page size, JESD216A and later
+    if(dwords>=11)
+    {
+        multiplier = 2*((dw[10] & 0xf)+1);
+        for(i=0; i<4; i++)
+        {
+            int field = (i==0) ? (dw[10]>>4) : (i==1) ? (dw[10]>>11) : (i==2) ? (dw[10]>>18) : (dw[10]>>25);
+            flash->erase_types[i].typical_ms = ((field & 0x1f)+1) * erase_units[(field>>5) & 0x3];
+            flash->erase_types[i].max_ms = multiplier * flash->erase_types[i].typical_ms;
+        }
+
+        multiplier = 2*((dw[11] & 0xf)+1);
+        flash->page_size = 1 << ((dw[11]>>4) & 0xf);
+        flash->program_typical_us = (((dw[11]>>8) & 0x1f)+1) * ((dw[11] & (1<<13)) ? 64 : 8);
+        flash->program_max_us = multiplier * flash->program_typical_us;
+        flash->chip_erase_typical_ms = (((dw[11]>>24) & 0x1f)+1) * chip_erase_units[(dw[11]>>29) & 0x3];
+        flash->chip_erase_max_ms = multiplier * flash->chip_erase_typical_ms;
+    }
+
+    if(dwords>=15)
+    {
+        flash->qe_requirement = (dw[15]>>20) & 0x7;
+    }
+
+    if(!FlashCheckConfig(flash))
+    {
+        printf("Info: %s, SFDP of flash 0x%06x is not valid, the defaults are used.\n", adapter->name.c_str(), flash->jedec_id);
+        FlashDefaults(flash, flash->jedec_id);
+        *valid = false;
+    }
+
+    return TCL_OK;
+}
+
+bool LoadSfdpCache(FlashConfig *flash)
+{
+    std::lock_guard <std::mutex> lock(CacheLock);
+    char name[32];
+    char line[128];
+    std::string path;
+    unsigned long long size;
+    unsigned int values[4];
+    int version = 0;
+    int count = 0;
+    FILE *fp;
+
+    snprintf(name, sizeof(name), "sfdp-%06x.txt", flash->jedec_id);
+    path = CachePath(name);
+    if( path.empty() || ((fp=fopen(path.c_str(), "r"))==NULL) )
+    {
+        return false;
+    }
+
+    while(fgets(line, sizeof(line), fp)!=NULL)
+    {
+        int sfdp;
+        if(sscanf(line, "usbio-sfdp %d", &version)==1) continue;
+        if(sscanf(line, "sfdp %d", &sfdp)==1) { flash->sfdp = (sfdp!=0); continue; }
+        if(sscanf(line, "size %llu", &size)==1) { flash->size = size; continue; }
+        if(sscanf(line, "four_byte_only %u", &values[0])==1) { flash->four_byte_only = (values[0]!=0); continue; }
+        if(sscanf(line, "page_size %u", &values[0])==1) { flash->page_size = values[0]; continue; }
+        if(sscanf(line, "erase %u %x %u %u", &values[0], &values[1], &values[2], &values[3])==4)
+        {
+            if(count==0) memset(flash->erase_types, 0, sizeof(flash->erase_types));
+            if(count<4)
+            {
+                flash->erase_types[count].size = values[0];
+                flash->erase_types[count].opcode = values[1];
+                flash->erase_types[count].typical_ms = values[2];
+                flash->erase_types[count].max_ms = values[3];
+                count++;
+            }
+            continue;
+        }
+        if(sscanf(line, "read_112 %x %u %u", &values[0], &values[1], &values[2])==3) { flash->read_112.opcode = values[0]; flash->read_112.dummy_clocks = values[1]; flash->read_112.mode_clocks = values[2]; continue; }
+        if(sscanf(line, "read_122 %x %u %u", &values[0], &values[1], &values[2])==3) { flash->read_122.opcode = values[0]; flash->read_122.dummy_clocks = values[1]; flash->read_122.mode_clocks = values[2]; continue; }
+        if(sscanf(line, "read_114 %x %u %u", &values[0], &values[1], &values[2])==3) { flash->read_114.opcode = values[0]; flash->read_114.dummy_clocks = values[1]; flash->read_114.mode_clocks = values[2]; continue; }
+        if(sscanf(line, "read_144 %x %u %u", &values[0], &values[1], &values[2])==3) { flash->read_144.opcode = values[0]; flash->read_144.dummy_clocks = values[1]; flash->read_144.mode_clocks = values[2]; continue; }
+        if(sscanf(line, "page_program %u %u", &values[0], &values[1])==2) { flash->program_typical_us = values[0]; flash->program_max_us = values[1]; continue; }
+        if(sscanf(line, "chip_erase %u %u", &values[0], &values[1])==2) { flash->chip_erase_typical_ms = values[0]; flash->chip_erase_max_ms = values[1]; continue; }
+        if(sscanf(line, "qe_requirement %u", &values[0])==1) { flash->qe_requirement = values[0]; continue; }
+    }
+    fclose(fp);
+
+    // a cache that fails the check is read from SFDP again
+    return (version==1) && FlashCheckConfig(flash);
+}
+
+void SaveSfdpCache(const FlashConfig *flash)
+{
+    std::lock_guard <std::mutex> lock(CacheLock);
+    const FlashReadMode *modes[4] = { &flash->read_112, &flash->read_122, &flash->read_114, &flash->read_144 };
+    const char *names[4] = { "read_112", "read_122", "read_114", "read_144" };
+    char name[32];
+    std::string path;
+    FILE *fp;
+    int i;
+
+    snprintf(name, sizeof(name), "sfdp-%06x.txt", flash->jedec_id);
+    path = CachePath(name);
+    if( path.empty() || ((fp=fopen(path.c_str(), "w"))==NULL) )
+    {
+        debug("Info: can't write SFDP cache %s.\n", path.c_str());
+        return;
+    }
+
+    fprintf(fp, "usbio-sfdp 1\n");
+    fprintf(fp, "jedec_id %06x\n", flash->jedec_id);
+    fprintf(fp, "sfdp %d\n", flash->sfdp ? 1 : 0);
+    fprintf(fp, "size %llu\n", (unsigned long long)flash->size);
+    fprintf(fp, "four_byte_only %d\n", flash->four_byte_only ? 1 : 0);
+    fprintf(fp, "page_size %u\n", flash->page_size);
+    for(i=0; i<4; i++)
+    {
+        if(flash->erase_types[i].size!=0)
+        {
+            fprintf(fp, "erase %u %02x %d %d\n", flash->erase_types[i].size, flash->erase_types[i].opcode, flash->erase_types[i].typical_ms, flash->erase_types[i].max_ms);
+        }
+    }
+    for(i=0; i<4; i++)
+    {
+        if(modes[i]->opcode!=0)
+        {
+            fprintf(fp, "%s %02x %d %d\n", names[i], modes[i]->opcode, modes[i]->dummy_clocks, modes[i]->mode_clocks);
+        }
+    }
+    fprintf(fp, "page_program %d %d\n", flash->program_typical_us, flash->program_max_us);
+    fprintf(fp, "chip_erase %d %d\n", flash->chip_erase_typical_ms, flash->chip_erase_max_ms);
+    fprintf(fp, "qe_requirement %d\n", flash->qe_requirement);
+    fclose(fp);
+}
+
+// typical times from the parameters, and what was learned kept as long as
+// it's the same flash
+void FlashInitTiming(FlashConfig *flash)
+{
+    int i;
+
+    if(flash->timing_id!=flash->jedec_id)
+    {
+        flash->timing_id = flash->jedec_id;
+        memset(&flash->program_timing, 0, sizeof(flash->program_timing));
+        memset(flash->erase_timing, 0, sizeof(flash->erase_timing));
+        memset(&flash->chip_erase_timing, 0, sizeof(flash->chip_erase_timing));
+    }
+
+    flash->program_timing.typical_us = flash->program_typical_us;
+    for(i=0; i<4; i++)
+    {
+        flash->erase_timing[i].typical_us = flash->erase_types[i].typical_ms*1000;
+    }
+    flash->chip_erase_timing.typical_us = (int)std::min(flash->chip_erase_typical_ms*1000LL, (long long)INT32_MAX);
+}
+
+// read the JEDEC ID, then the parameters from the cache or SFDP
+int FlashProbe(Adapter *adapter, bool reread)
+{
+    FlashConfig *flash = &adapter->flash;
+    unsigned char tx = 0x9f;
+    unsigned char id[3];
+    uint32 jedec_id;
+    bool valid;
+
+    if(FlashTransfer(adapter, &tx, 1, id, 3)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    jedec_id = (id[0]<<16) | (id[1]<<8) | id[2];
+    FlashDefaults(flash, jedec_id);
+
+    // no flash answers all 0s or 1s, which is not worth caching
+    if( (jedec_id!=0) && (jedec_id!=0xffffff) && (reread || !LoadSfdpCache(flash)) )
+    {
+        FlashDefaults(flash, jedec_id);
+        if(FlashParseSfdp(adapter, flash, &valid)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        if(valid)
+        {
+            SaveSfdpCache(flash);
+        }
+    }
+
+    flash->address_bytes = ( flash->four_byte_only || (flash->size>FLASH_3BYTE_SIZE) ) ? 4 : 3;
+    FlashInitTiming(flash);
+    flash->unique_id_read = false;
+    flash->unique_id.clear();
+    flash->probed = true;
+
+    debug("Info: %s, flash JEDEC ID 0x%06x, %llu byte(s), %d-byte address, %s.\n", adapter->name.c_str(),
+        flash->jedec_id, (unsigned long long)flash->size, flash->address_bytes, flash->sfdp ? "SFDP" : "no SFDP");
+    return TCL_OK;
+}
+
+//
+// sector index
+//
+// A hash of every sector flash program -diff has read back is kept per
+// flash, in <cache dir>/index-<jedec_id>-<unique_id>.txt, keyed by the
+// 64-bit unique ID read with 0x4B. Reprogramming a known flash then takes
+// the hashes of the sectors from there instead of reading them back.
+// Only the vendors known to answer 0x4B with a unique ID get an index, on
+// others 0x4B may be another command, and the ID is read again on every
+// run, as the flash may have been swapped.
+// Any other write to the flash, by the flash commands or by the SPI
+// commands of the script, removes the index file before it's sent, and
+// sets adapter->index_stale. Writes by other tools can't be seen, use
+// -nocache after them.
+//
+typedef std::map <uint32, uint64> FlashIndex;
+
+// the unique ID as hex, or empty if the flash has none, only Winbond and
+// GigaDevice are known to have it with 0x4B
+const std::string& FlashUniqueId(Adapter *adapter)
+{
+    static const unsigned char vendors[] = { 0xef, 0xc8 };
+    FlashConfig *flash = &adapter->flash;
+    unsigned char tx[5] = { 0x4b, 0x00, 0x00, 0x00, 0x00 };
+    unsigned char id[8];
+    char hex[17];
+    int ones = 0;
+    int zeros = 0;
+    int i;
+
+    if(flash->unique_id_read)
+    {
+        return flash->unique_id;
+    }
+
+    flash->unique_id_read = true;
+    flash->unique_id.clear();
+    if(memchr(vendors, (flash->jedec_id>>16) & 0xff, sizeof(vendors))==NULL)
+    {
+        debug("Info: %s, flash vendor 0x%02x has no known unique ID.\n", adapter->name.c_str(), (flash->jedec_id>>16) & 0xff);
+        return flash->unique_id;
+    }
+
+    if(FlashTransfer(adapter, tx, 5, id, 8)!=TCL_OK)
+    {
+        adapter->error.clear();
+        return flash->unique_id;
+    }
+
+    for(i=0; i<8; i++)
+    {
+        ones += (id[i]==0xff);
+        zeros += (id[i]==0x00);
+        snprintf(hex+2*i, 3, "%02x", id[i]);
+    }
+
+    // flash without 0x4B answers all 0s or 1s
+    if( (ones!=8) && (zeros!=8) )
+    {
+        flash->unique_id = hex;
+    }
+
+    debug("Info: %s, flash unique ID %s.\n", adapter->name.c_str(), flash->unique_id.empty() ? "none" : hex);
+    return flash->unique_id;
+}
+
+std::string FlashIndexPath(Adapter *adapter)
+{
+    char name[48];
+
+    snprintf(name, sizeof(name), "index-%06x-%s.txt", adapter->flash.jedec_id, adapter->flash.unique_id.c_str());
+    return CachePath(name);
+}
+
+// removes the files of the cache directory matching pattern
+void RemoveCacheFiles(const char *pattern)
+{
+    std::string dir = CachePath("");
+    Tcl_Obj *dirObj;
+    Tcl_Obj *listObj;
+    Tcl_Obj **files;
+    int count;
+    int i;
+
+    if(dir.empty())
+    {
+        return;
+    }
+
+    dirObj = Tcl_NewStringObj(dir.c_str(), (int)dir.size()-1);
+    listObj = Tcl_NewObj();
+    Tcl_IncrRefCount(dirObj);
+    Tcl_IncrRefCount(listObj);
+    if( (Tcl_FSMatchInDirectory(NULL, listObj, dirObj, pattern, NULL)==TCL_OK) &&
+        (Tcl_ListObjGetElements(NULL, listObj, &count, &files)==TCL_OK) )
+    {
+        for(i=0; i<count; i++)
+        {
+            Tcl_FSDeleteFile(files[i]);
+        }
+    }
+    Tcl_DecrRefCount(listObj);
+    Tcl_DecrRefCount(dirObj);
+}
+
+// The flash is being written, the index on disk is no longer true, and is
+// removed before the first write, as the next run may be another process.
+// The flash commands read the unique ID to find it. An SPI write of the
+// script may be in the middle of a CS window, where no 0x4B can be sent,
+// so without the ID it removes the index of every flash of the JEDEC ID,
+// or of any flash if it's not probed.
+void FlashIndexInvalidate(Adapter *adapter, bool read_id)
+{
+    char pattern[32];
+
+    if( !read_id && adapter->index_stale )
+    {
+        return;
+    }
+
+    if( read_id && adapter->flash.probed )
+    {
+        FlashUniqueId(adapter);
+    }
+
+    adapter->index_stale = true;
+    std::lock_guard <std::mutex> lock(CacheLock);
+    if( adapter->flash.probed && adapter->flash.unique_id_read )
+    {
+        if(!adapter->flash.unique_id.empty())
+        {
+            remove(FlashIndexPath(adapter).c_str());
+        }
+        return;
+    }
+
+    if(adapter->flash.probed)
+    {
+        snprintf(pattern, sizeof(pattern), "index-%06x-*.txt", adapter->flash.jedec_id);
+    }
+    else
+    {
+        snprintf(pattern, sizeof(pattern), "index-*.txt");
+    }
+    RemoveCacheFiles(pattern);
+}
+
+// An SPI write of the script, unless it starts with a read-only opcode.
+// A later part of a CS window may start with anything, but its first part
+// has the opcode.
+void FlashScriptWrite(Adapter *adapter, const unsigned char *tx, int length)
+{
+    static const unsigned char read_only[] =
+    {
+        0x03, 0x0b, 0x3b, 0x6b, 0xbb, 0xeb, 0x13, 0x0c, 0x3c, 0x6c, 0xbc, 0xec,
+        0x04, 0x05, 0x06, 0x15, 0x35, 0x3f, 0x4b, 0x5a, 0x90, 0x9f, 0xab
+    };
+
+    if( (length>0) && (memchr(read_only, tx[0], sizeof(read_only))!=NULL) )
+    {
+        return;
+    }
+
+    FlashIndexInvalidate(adapter, false);
+}
+
+// false if the flash has no unique ID, or no index, or it's stale
+bool LoadFlashIndex(Adapter *adapter, uint32 sector_size, FlashIndex *index)
+{
+    std::string path;
+    char line[64];
+    unsigned int address;
+    unsigned int size = 0;
+    unsigned long long hash;
+    int version = 0;
+    FILE *fp;
+
+    index->clear();
+    if(FlashUniqueId(adapter).empty())
+    {
+        return false;
+    }
+
+    std::lock_guard <std::mutex> lock(CacheLock);
+    path = FlashIndexPath(adapter);
+    if(adapter->index_stale)
+    {
+        remove(path.c_str());
+        return false;
+    }
+
+    if( path.empty() || ((fp=fopen(path.c_str(), "r"))==NULL) )
+    {
+        return false;
+    }
+
+    while(fgets(line, sizeof(line), fp)!=NULL)
+    {
+        if(sscanf(line, "usbio-index %d", &version)==1) continue;
+        if(sscanf(line, "sector_size %u", &size)==1) continue;
+        if(sscanf(line, "%x %llx", &address, &hash)==2) (*index)[address] = hash;
+    }
+    fclose(fp);
+
+    if( (version!=1) || (size!=sector_size) )
+    {
+        index->clear();
+        return false;
+    }
+
+    return true;
+}
+
+void SaveFlashIndex(Adapter *adapter, uint32 sector_size, const FlashIndex &index)
+{
+    std::lock_guard <std::mutex> lock(CacheLock);
+    std::string path;
+    FlashIndex::const_iterator it;
+    FILE *fp;
+
+    path = FlashIndexPath(adapter);
+    if( path.empty() || ((fp=fopen(path.c_str(), "w"))==NULL) )
+    {
+        debug("Info: can't write flash index %s.\n", path.c_str());
+        return;
+    }
+
+    fprintf(fp, "usbio-index 1\n");
+    fprintf(fp, "jedec_id %06x\n", adapter->flash.jedec_id);
+    fprintf(fp, "unique_id %s\n", adapter->flash.unique_id.c_str());
+    fprintf(fp, "sector_size %u\n", sector_size);
+    for(it=index.begin(); it!=index.end(); ++it)
+    {
+        fprintf(fp, "%08x %016llx\n", it->first, (unsigned long long)it->second);
+    }
+    fclose(fp);
+    adapter->index_stale = false;
+}
+
+// the 4-byte address version of a 3-byte address command
+unsigned char Flash4ByteOpcode(unsigned char opcode)
+{
+    switch(opcode)
+    {
+        case 0x03: return 0x13;
+        case 0x0b: return 0x0c;
+        case 0x3b: return 0x3c;
+        case 0xbb: return 0xbc;
+        case 0x6b: return 0x6c;
+        case 0xeb: return 0xec;
+        case 0x02: return 0x12;
+        case 0x32: return 0x34;
+        case 0x20: return 0x21;
+        case 0x52: return 0x5c;
+        case 0xd8: return 0xdc;
+        default  : return opcode;
+    }
+}
+
+// opcode and address, returns the length
+int FlashHeader(Adapter *adapter, unsigned char *tx, unsigned char opcode, uint32 address)
+{
+    if(adapter->flash.address_bytes==4)
+    {
+        tx[0] = Flash4ByteOpcode(opcode);
+        tx[1] = (unsigned char)(address>>24);
+        tx[2] = (unsigned char)(address>>16);
+        tx[3] = (unsigned char)(address>>8);
+        tx[4] = (unsigned char)address;
+        return 5;
+    }
+
+    tx[0] = opcode;
+    tx[1] = (unsigned char)(address>>16);
+    tx[2] = (unsigned char)(address>>8);
+    tx[3] = (unsigned char)address;
+    return 4;
+}
+
+// checks the range against the flash, probing it first if needed
+int FlashCheckRange(Adapter *adapter, uint32 address, int length)
+{
+    if( !adapter->flash.probed && (FlashProbe(adapter, false)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    if( (adapter->flash.size!=0) && ((uint64)address+length > adapter->flash.size) )
+    {
+        return FlashError(adapter, "0x%x+%d is beyond the flash size %llu", address, length, (unsigned long long)adapter->flash.size);
+    }
+
+    if( (adapter->flash.address_bytes==3) && ((uint64)address+length > FLASH_3BYTE_SIZE) )
+    {
+        return FlashError(adapter, "0x%x+%d is beyond 3-byte address", address, length);
+    }
+
+    return TCL_OK;
+}
+
+// the smallest erase type
+const FlashEraseType* FlashSectorType(Adapter *adapter)
+{
+    const FlashEraseType *sector = NULL;
+    int i;
+
+    for(i=0; i<4; i++)
+    {
+        if( (adapter->flash.erase_types[i].size!=0) && ((sector==NULL) || (adapter->flash.erase_types[i].size<sector->size)) )
+        {
+            sector = &adapter->flash.erase_types[i];
+        }
+    }
+
+    return sector;
+}
+
+int FlashWriteEnable(Adapter *adapter)
+{
+    unsigned char tx = 0x06;
+
+    return FlashTransfer(adapter, &tx, 1, NULL, 0);
+}
+
+// poll WIP of the status register until it's cleared
+// Sleeps through most of the expected time of the program/erase, as
+// learned or from SFDP, then polls the status with a bounded interval.
+// The time the flash is seen ready is learned for the next one, taken
+// shorter if it was ready on the first poll, as it may have been ready
+// well before. The status command of every poll is a USB round trip, so
+// short sleeps that the OS can't do are left out.
+int FlashWaitReady(Adapter *adapter, FlashTiming *timing, int timeout_ms)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    unsigned char tx = 0x05;
+    unsigned char status;
+    long long expected_us = 0;
+    int interval_us = 0;
+    long long elapsed_us;
+    int polls = 0;
+
+    // in 64-bit, a chip erase may be near INT32_MAX us
+    if(timing!=NULL)
+    {
+        expected_us = timing->learned_us ? timing->learned_us : timing->typical_us;
+        interval_us = (int)std::min(expected_us/16, (long long)FLASH_POLL_MAX_US);
+    }
+
+    if(expected_us*9/10 >= FLASH_SLEEP_MIN_US)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(expected_us*9/10));
+    }
+
+    while(true)
+    {
+        if(FlashTransfer(adapter, &tx, 1, &status, 1)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+
+        elapsed_us = (long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count();
+        polls++;
+        if((status & 0x01)==0)
+        {
+            break;
+        }
+
+        if(elapsed_us > timeout_ms*1000LL)
+        {
+            return FlashError(adapter, "flash busy for more than %d ms, status 0x%02x", timeout_ms, status);
+        }
+
+        if(interval_us >= FLASH_SLEEP_MIN_US)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+        }
+    }
+
+    if(timing!=NULL)
+    {
+        elapsed_us = (polls==1) ? elapsed_us*3/4 : elapsed_us;
+        elapsed_us = timing->count ? (timing->learned_us + elapsed_us)/2 : elapsed_us;
+        timing->learned_us = (int)std::min(elapsed_us, (long long)INT_MAX);
+        timing->count++;
+    }
+
+    return TCL_OK;
+}
+
+// sends the erase, with no wait
+int FlashStartBlockErase(Adapter *adapter, const FlashEraseType *type, uint32 address)
+{
+    unsigned char tx[5];
+    int tx_length = FlashHeader(adapter, tx, type->opcode, address);
+
+    if( (FlashWriteEnable(adapter)!=TCL_OK) || (FlashTransfer(adapter, tx, tx_length, NULL, 0)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+int FlashBlockErase(Adapter *adapter, const FlashEraseType *type, uint32 address)
+{
+    if(FlashStartBlockErase(adapter, type, address)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    return FlashWaitReady(adapter, &adapter->flash.erase_timing[type-adapter->flash.erase_types], std::max(type->max_ms, FLASH_ERASE_TIMEOUT));
+}
+
+// Builds the page program frame, opcode and address followed by the data,
+// in tx, and returns its length. length must not cross a page boundary.
+int FlashPageFrame(Adapter *adapter, unsigned char *tx, uint32 address, const unsigned char *data, int length, bool quad)
+{
+    int tx_length;
+
+    tx_length = FlashHeader(adapter, tx, quad ? 0x32 : 0x02, address);
+    memcpy(tx+tx_length, data, length);
+    return tx_length+length;
+}
+
+// Sends a frame of FlashPageFrame after write enable, with no wait. With
+// quad, opcode and address are sent on a single line, and the data on four
+// lines.
+int FlashSendPageFrame(Adapter *adapter, unsigned char *tx, int tx_length, bool quad)
+{
+    FT_STATUS ftStatus;
+    uint32 sizeOfRead;
+    unsigned char rx_dummy;
+    int header_length = adapter->flash.address_bytes+1;
+
+    if(FlashWriteEnable(adapter)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    if(quad)
+    {
+        if(FlashSetLines(adapter, 4)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+
+        ftStatus = FT4222_SPIMaster_MultiReadWrite(adapter->handle, &rx_dummy, tx, (uint8)header_length, (uint16)(tx_length-header_length), 0, &sizeOfRead);
+        if(ftStatus!=FT_OK)
+        {
+            return FlashError(adapter, "flash command 0x%02x returns(%d), %s", tx[0], ftStatus, FT4222StatusString(ftStatus));
+        }
+    }
+    else if(FlashTransfer(adapter, tx, tx_length, NULL, 0)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+// Sends the page program, with no wait. length must not cross a page
+// boundary.
+int FlashStartPageProgram(Adapter *adapter, uint32 address, const unsigned char *data, int length, bool quad)
+{
+    std::vector <unsigned char> &tx = adapter->flash.buffer;
+
+    tx.resize(5+length);
+    return FlashSendPageFrame(adapter, &tx[0], FlashPageFrame(adapter, &tx[0], address, data, length, quad), quad);
+}
+
+int FlashPageProgram(Adapter *adapter, uint32 address, const unsigned char *data, int length, bool quad)
+{
+    if(FlashStartPageProgram(adapter, address, data, length, quad)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    return FlashWaitReady(adapter, &adapter->flash.program_timing, std::max(adapter->flash.program_max_us/1000, FLASH_PROGRAM_TIMEOUT));
+}
+
+// QE of the status register, which must be set for quad transfers
+int FlashQuadEnabled(Adapter *adapter, bool *enabled)
+{
+    unsigned char tx;
+    unsigned char status;
+    int bit;
+
+    switch(adapter->flash.qe_requirement)
+    {
+        case 0  : *enabled = adapter->flash.sfdp; return TCL_OK;
+        case 2  : tx = 0x05; bit = 6; break;
+        case 3  : tx = 0x3f; bit = 7; break;
+        default : tx = 0x35; bit = 1; break;
+    }
+
+    if(FlashTransfer(adapter, &tx, 1, &status, 1)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    *enabled = (status>>bit) & 0x1;
+    return TCL_OK;
+}
+
+// set QE as the quad enable requirement of SFDP says, if it's not set yet
+int FlashSetQuadEnable(Adapter *adapter)
+{
+    unsigned char tx[3];
+    unsigned char status1;
+    unsigned char status2;
+    bool enabled;
+    int tx_length;
+
+    if( !adapter->flash.sfdp || (adapter->flash.qe_requirement>6) )
+    {
+        return FlashError(adapter, "quad enable of the flash is unknown");
+    }
+
+    if(FlashQuadEnabled(adapter, &enabled)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    if(enabled || (adapter->flash.qe_requirement==0))
+    {
+        return TCL_OK;
+    }
+
+    tx[0] = 0x05;
+    if(FlashTransfer(adapter, tx, 1, &status1, 1)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    tx[0] = (adapter->flash.qe_requirement==3) ? 0x3f : 0x35;
+    if( (adapter->flash.qe_requirement!=2) && (FlashTransfer(adapter, tx, 1, &status2, 1)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    switch(adapter->flash.qe_requirement)
+    {
+        case 2  : tx[0] = 0x01; tx[1] = status1 | 0x40; tx_length = 2; break;
+        case 3  : tx[0] = 0x3e; tx[1] = status2 | 0x80; tx_length = 2; break;
+        case 6  : tx[0] = 0x31; tx[1] = status2 | 0x02; tx_length = 2; break;
+        default : tx[0] = 0x01; tx[1] = status1; tx[2] = status2 | 0x02; tx_length = 3; break;
+    }
+
+    if( (FlashWriteEnable(adapter)!=TCL_OK) || (FlashTransfer(adapter, tx, tx_length, NULL, 0)!=TCL_OK) ||
+        (FlashWaitReady(adapter, NULL, FLASH_ERASE_TIMEOUT)!=TCL_OK) || (FlashQuadEnabled(adapter, &enabled)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    if(!enabled)
+    {
+        return FlashError(adapter, "QE can't be set, the status register may be protected");
+    }
+
+    debug("Info: %s, flash QE set.\n", adapter->name.c_str());
+    return TCL_OK;
+}
+
+const char *FlashProgramModeNames[] = { "auto", "single", "quad", NULL };
+
+const char *FlashReadModeNames[] = { "auto", "read", "fast", "dual", "dual_io", "quad", "quad_io", NULL };
+
+// the read command of a mode, from SFDP, or the common one if the flash
+// has no SFDP, false if the flash or the adapter doesn't support it
+bool FlashGetReadCommand(Adapter *adapter, int mode, FlashReadCommand *command)
+{
+    const FlashReadMode *sfdp = NULL;
+    FlashReadMode common = { 0, 8, 0 };
+
+    command->address_lines = 1;
+    command->data_lines = 1;
+    switch(mode)
+    {
+        case FLASH_READ_NORMAL  : common.opcode = 0x03; common.dummy_clocks = 0; break;
+        case FLASH_READ_FAST    : common.opcode = 0x0b; break;
+        case FLASH_READ_DUAL    : common.opcode = 0x3b; sfdp = &adapter->flash.read_112; command->data_lines = 2; break;
+        case FLASH_READ_DUAL_IO : common.opcode = 0xbb; common.dummy_clocks = 0; common.mode_clocks = 4; sfdp = &adapter->flash.read_122; command->address_lines = command->data_lines = 2; break;
+        case FLASH_READ_QUAD    : common.opcode = 0x6b; sfdp = &adapter->flash.read_114; command->data_lines = 4; break;
+        case FLASH_READ_QUAD_IO : common.opcode = 0xeb; common.dummy_clocks = 4; common.mode_clocks = 2; sfdp = &adapter->flash.read_144; command->address_lines = command->data_lines = 4; break;
+        default                 : return false;
+    }
+
+    if( (sfdp!=NULL) && adapter->flash.sfdp )
+    {
+        if(sfdp->opcode==0)
+        {
+            return false;
+        }
+        common = *sfdp;
+    }
+
+    command->opcode = common.opcode;
+    command->dummy_clocks = common.dummy_clocks;
+    command->mode_clocks = common.mode_clocks;
+
+    // the lines of the adapter, and whole bytes of mode and dummy clocks
+    return (command->data_lines<=std::max(adapter->config.max_lines, 1)) &&
+           ((command->dummy_clocks+command->mode_clocks)*command->address_lines % 8 == 0);
+}
+
+// the fastest read the flash and the adapter support, quad only if QE is set
+int FlashAutoReadCommand(Adapter *adapter, FlashReadCommand *command)
+{
+    static const int modes[] = { FLASH_READ_QUAD_IO, FLASH_READ_QUAD, FLASH_READ_DUAL_IO, FLASH_READ_DUAL };
+    bool quad_enabled = false;
+    bool quad_checked = false;
+    int i;
+
+    // the common opcodes and dummy clocks of the multi line reads are not
+    // known to work on a flash without SFDP, they're for an explicit -mode
+    for(i=0; adapter->flash.sfdp && (i<4); i++)
+    {
+        if(!FlashGetReadCommand(adapter, modes[i], command))
+        {
+            continue;
+        }
+
+        if(command->data_lines==4)
+        {
+            if( !quad_checked && (FlashQuadEnabled(adapter, &quad_enabled)!=TCL_OK) )
+            {
+                return TCL_ERROR;
+            }
+            quad_checked = true;
+            if(!quad_enabled)
+            {
+                continue;
+            }
+        }
+
+        return TCL_OK;
+    }
+
+    FlashGetReadCommand(adapter, adapter->flash.sfdp ? FLASH_READ_FAST : FLASH_READ_NORMAL, command);
+    return TCL_OK;
+}
+
+// dual/quad read through MultiReadWrite, one command per chunk since every
+// call is a CS window of its own
+int FlashMultiRead(Adapter *adapter, const FlashReadCommand *command, uint32 address, unsigned char *buffer, int length)
+{
+    FT_STATUS ftStatus;
+    unsigned char tx[16];
+    int tx_length;
+    int single_length;
+    uint32 sizeOfRead;
+    int offset;
+    int size;
+
+    if(FlashSetLines(adapter, command->data_lines)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    for(offset=0; offset<length; offset+=size)
+    {
+        size = std::min(length-offset, FLASH_MULTI_READ_SIZE);
+
+        // mode and dummy clocks are sent as 0xff, which is not continuous read mode
+        tx_length = FlashHeader(adapter, tx, command->opcode, address+offset);
+        memset(tx+tx_length, 0xff, (command->dummy_clocks+command->mode_clocks)*command->address_lines/8);
+        tx_length += (command->dummy_clocks+command->mode_clocks)*command->address_lines/8;
+        single_length = (command->address_lines==1) ? tx_length : 1;
+
+        sizeOfRead = 0;
+        ftStatus = FT4222_SPIMaster_MultiReadWrite(adapter->handle, buffer+offset, tx, (uint8)single_length, (uint16)(tx_length-single_length), (uint16)size, &sizeOfRead);
+        if(ftStatus!=FT_OK)
+        {
+            return FlashError(adapter, "flash command 0x%02x returns(%d), %s", tx[0], ftStatus, FT4222StatusString(ftStatus));
+        }
+
+        if((int)sizeOfRead!=size)
+        {
+            return FlashError(adapter, "flash command 0x%02x transfers %d of %d byte(s)", tx[0], (int)sizeOfRead, size);
+        }
+    }
+
+    return TCL_OK;
+}
+
+int FlashRead(Adapter *adapter, uint32 address, unsigned char *buffer, int length, int mode)
+{
+    FlashReadCommand command;
+    unsigned char tx[16];
+    int tx_length;
+
+    if( (FlashCheckRange(adapter, address, length)!=TCL_OK) || (FlushPendingWrite(adapter)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    if(mode==FLASH_READ_AUTO)
+    {
+        if(FlashAutoReadCommand(adapter, &command)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+    else if(!FlashGetReadCommand(adapter, mode, &command))
+    {
+        return FlashError(adapter, "%s read is not supported by the flash or the adapter", FlashReadModeNames[mode]);
+    }
+
+    if(command.data_lines>1)
+    {
+        return FlashMultiRead(adapter, &command, address, buffer, length);
+    }
+
+    tx_length = FlashHeader(adapter, tx, command.opcode, address);
+    memset(tx+tx_length, 0xff, command.dummy_clocks/8);
+    tx_length += command.dummy_clocks/8;
+    return FlashTransfer(adapter, tx, tx_length, buffer, length);
+}
+
+// the typical time of an erase type from SFDP, or the max time, or else
+// the size, so a larger block wins when the flash tells nothing
+int FlashEraseTime(const FlashEraseType *type)
+{
+    if(type->typical_ms!=0)
+    {
+        return type->typical_ms;
+    }
+
+    if(type->max_ms!=0)
+    {
+        return type->max_ms;
+    }
+
+    return (int)(type->size/FLASH_SECTOR_SIZE) + 1;
+}
+
+int FlashChipErase(Adapter *adapter)
+{
+    unsigned char tx = 0xc7;
+
+    if( (FlashWriteEnable(adapter)!=TCL_OK) || (FlashTransfer(adapter, &tx, 1, NULL, 0)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    return FlashWaitReady(adapter, &adapter->flash.chip_erase_timing, std::max(adapter->flash.chip_erase_max_ms, FLASH_CHIP_ERASE_TIMEOUT));
+}
+
+// Covers the sectors of [start, end) with the erase types of the least
+// total time, each aligned to its size. plan gets the type of every
+// erase, NULL for a chip erase, which covers the whole flash.
+// Chip erase is taken when the range is the whole flash, or if chip is
+// true and the rest of the flash may be erased too, and it's faster.
+int FlashErasePlan(Adapter *adapter, uint32 start, uint64 end, bool chip, std::vector < std::pair <const FlashEraseType*, uint32> > *plan)
+{
+    const FlashEraseType *sector = FlashSectorType(adapter);
+    const FlashEraseType *type;
+    std::vector <int64_t> cost;
+    std::vector <const FlashEraseType*> choice;
+    uint32 unit = sector->size;
+    int count = (int)(((uint64)end - start) / unit);
+    int64_t time;
+    int chip_ms;
+    int blocks;
+    int i;
+    int t;
+
+    cost.assign(count+1, 0);
+    choice.assign(count, sector);
+    for(i=count-1; i>=0; i--)
+    {
+        cost[i] = -1;
+        for(t=0; t<4; t++)
+        {
+            type = &adapter->flash.erase_types[t];
+            blocks = (int)(type->size/unit);
+            if( (type->size==0) || (((start+(uint64)i*unit) % type->size)!=0) || (i+blocks>count) )
+            {
+                continue;
+            }
+
+            time = FlashEraseTime(type) + cost[i+blocks];
+            if( (cost[i]<0) || (time<cost[i]) )
+            {
+                cost[i] = time;
+                choice[i] = type;
+            }
+        }
+    }
+
+    plan->clear();
+    chip_ms = adapter->flash.chip_erase_typical_ms ? adapter->flash.chip_erase_typical_ms : adapter->flash.chip_erase_max_ms;
+    if( (count>0) && (adapter->flash.size!=0) &&
+        (((start==0) && (end==adapter->flash.size)) || chip) && (chip_ms<cost[0]) )
+    {
+        plan->push_back(std::make_pair((const FlashEraseType*)NULL, (uint32)0));
+        return chip_ms;
+    }
+
+    for(i=0; i<count; i+=(int)(choice[i]->size/unit))
+    {
+        plan->push_back(std::make_pair(choice[i], start + i*unit));
+    }
+
+    return (int)cost[0];
+}
+
+int FlashEraseBlocks(Adapter *adapter, uint32 start, uint64 end, bool chip)
+{
+    std::vector < std::pair <const FlashEraseType*, uint32> > plan;
+    size_t i;
+
+    FlashErasePlan(adapter, start, end, chip, &plan);
+    debug("Info: %s, erase 0x%x-0x%llx with %d erase(s).\n", adapter->name.c_str(), start, (unsigned long long)end, (int)plan.size());
+
+    FlashIndexInvalidate(adapter, true);
+    for(i=0; i<plan.size(); i++)
+    {
+        if( ((plan[i].first==NULL) ? FlashChipErase(adapter) : FlashBlockErase(adapter, plan[i].first, plan[i].second))!=TCL_OK )
+        {
+            return TCL_ERROR;
+        }
+    }
+
+    return TCL_OK;
+}
+
+// erase the sectors covering the range, see FlashErasePlan
+int FlashErase(Adapter *adapter, uint32 address, int length, bool chip)
+{
+    const FlashEraseType *sector;
+    uint32 start;
+    uint64 end;
+
+    if( (FlashCheckRange(adapter, address, length)!=TCL_OK) || (FlushPendingWrite(adapter)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    sector = FlashSectorType(adapter);
+    if(sector==NULL)
+    {
+        return FlashError(adapter, "flash has no erase command");
+    }
+
+    if(length==0)
+    {
+        return TCL_OK;
+    }
+
+    start = address & ~(sector->size-1);
+    end = ((uint64)address + length + sector->size - 1) & ~(uint64)(sector->size-1);
+    return FlashEraseBlocks(adapter, start, end, chip);
+}
+
+// picks 0x02 or 0x32 for the program mode, and sets QE for quad. auto is
+// single, QE is non-volatile on most flash and takes WP#/HOLD# away from
+// the board, so it's only set when the script asks for quad
+int FlashProgramMode(Adapter *adapter, int mode, bool *quad)
+{
+    *quad = (mode==FLASH_PROGRAM_QUAD);
+    if( *quad && (adapter->config.max_lines<4) )
+    {
+        return FlashError(adapter, "quad program needs spi_master_init with 4 lines");
+    }
+
+    if( *quad && (FlashSetQuadEnable(adapter)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    return TCL_OK;
+}
+
+//
+// blank check
+//
+// An erased flash reads 0xff, and programming 0xff changes nothing, so
+// pages of all 0xff are not sent at all. The scan uses AVX2 if the CPU has
+// it, SSE2 on x86, or NEON on arm, 64 bytes at a time. NEON is always
+// there on aarch64, armv7 needs -mfpu=neon or the scan is scalar.
+//
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("avx2")))
+int BlankAvx2(const unsigned char *data, int length)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    __m256i all;
+    int i;
+
+    for(i=0; i+64<=length; i+=64)
+    {
+        all = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(data+i)), _mm256_loadu_si256((const __m256i*)(data+i+32)));
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(all, ones))!=-1)
+        {
+            return -1;
+        }
+    }
+
+    return i;
+}
+
+__attribute__((target("sse2")))
+int BlankSse2(const unsigned char *data, int length)
+{
+    const __m128i ones = _mm_set1_epi8(-1);
+    __m128i all;
+    int i;
+
+    for(i=0; i+64<=length; i+=64)
+    {
+        all = _mm_and_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(data+i)), _mm_loadu_si128((const __m128i*)(data+i+16))),
+                            _mm_and_si128(_mm_loadu_si128((const __m128i*)(data+i+32)), _mm_loadu_si128((const __m128i*)(data+i+48))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(all, ones))!=0xffff)
+        {
+            return -1;
+        }
+    }
+
+    return i;
+}
+#endif
+
+// true if every byte is 0xff
+bool FlashBlank(const unsigned char *data, int length)
+{
+    int i = 0;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    static const bool sse2 = __builtin_cpu_supports("sse2");
+
+    i = avx2 ? BlankAvx2(data, length) : sse2 ? BlankSse2(data, length) : 0;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x16_t all;
+    uint64x2_t lanes;
+
+    for(; i+64<=length; i+=64)
+    {
+        all = vandq_u8(vandq_u8(vld1q_u8(data+i), vld1q_u8(data+i+16)), vandq_u8(vld1q_u8(data+i+32), vld1q_u8(data+i+48)));
+        lanes = vreinterpretq_u64_u8(all);
+        if((vgetq_lane_u64(lanes, 0) & vgetq_lane_u64(lanes, 1))!=~(uint64_t)0)
+        {
+            return false;
+        }
+    }
+#endif
+
+    if(i<0)
+    {
+        return false;
+    }
+
+    for(; i<length; i++)
+    {
+        if(data[i]!=0xff)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// pages of all 0xff are skipped, and counted in elided
+int FlashProgramPages(Adapter *adapter, uint32 address, const unsigned char *data, int length, bool quad, int *elided)
+{
+    int page_size = adapter->flash.page_size;
+    int offset;
+    int size;
+
+    for(offset=0; offset<length; offset+=size)
+    {
+        size = std::min(length-offset, page_size - (int)((address+offset) % page_size));
+        if(FlashBlank(data+offset, size))
+        {
+            (*elided)++;
+            continue;
+        }
+
+        if(FlashPageProgram(adapter, address+offset, data+offset, size, quad)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+    }
+
+    return TCL_OK;
+}
+
+// erase the range as erase says, then program it page by page
+int FlashProgram(Adapter *adapter, uint32 address, const unsigned char *data, int length, int erase, int mode, int *elided)
+{
+    bool quad;
+
+    if( (FlashCheckRange(adapter, address, length)!=TCL_OK) || (FlushPendingWrite(adapter)!=TCL_OK) ||
+        (FlashProgramMode(adapter, mode, &quad)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    if( (erase!=FLASH_ERASE_NONE) && (FlashErase(adapter, address, length, erase==FLASH_ERASE_CHIP)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    FlashIndexInvalidate(adapter, true);
+    *elided = 0;
+    return FlashProgramPages(adapter, address, data, length, quad, elided);
+}
+
+// 64-bit FNV-1a, continued from hash for a stream
+uint64 FlashHash(const unsigned char *data, int length, uint64 hash = FLASH_HASH_SEED)
+{
+    int i;
+
+    for(i=0; i<length; i++)
+    {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// runs fn(0) ... fn(count-1) on a pool of threads, one per core
+void ParallelFor(int count, const std::function<void(int)> &fn)
+{
+    std::vector <std::thread> threads;
+    std::atomic <int> next(0);
+    int n;
+    int i;
+
+    auto run = [&]()
+    {
+        int index;
+
+        while( (index=next++) < count )
+        {
+            fn(index);
+        }
+    };
+
+    n = std::min((int)std::thread::hardware_concurrency(), count/16);
+    for(i=1; i<n; i++)
+    {
+        threads.push_back(std::thread(run));
+    }
+    run();
+
+    for(i=0; i<(int)threads.size(); i++)
+    {
+        threads[i].join();
+    }
+}
+
+// Differential program: hashes each sector covering the range against the
+// image on the thread pool, and erases and programs only the sectors that
+// differ. The hash of the flash sector is taken from the sector index if
+// the flash is known, or read back otherwise. The bytes of a partial
+// sector outside the range are kept, so partial sectors are always read
+// back. A changed sector that is blank is programmed with no erase.
+// The programmed sectors are read back, and the index keeps only hashes
+// of what was read from the flash.
+// written and skipped count the bytes of the sectors.
+int FlashProgramDiff(Adapter *adapter, uint32 address, const unsigned char *data, int length, int mode, bool cache, uint64 *written, uint64 *skipped, int *elided)
+{
+    const FlashEraseType *sector;
+    std::vector <unsigned char> image;
+    std::vector <uint64> current;
+    std::vector <uint64> hashes;
+    std::vector <char> known;
+    std::vector <char> blank;
+    std::vector <char> changed;
+    std::vector <unsigned char> erased;
+    uint64 blank_hash;
+    FlashIndex index;
+    FlashIndex::iterator it;
+    uint32 start;
+    uint32 end;
+    uint32 block;
+    int count;
+    int first;
+    int last;
+    bool quad;
+    int i;
+    int j;
+
+    *written = 0;
+    *skipped = 0;
+    *elided = 0;
+    if( (FlashCheckRange(adapter, address, length)!=TCL_OK) || (FlushPendingWrite(adapter)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    sector = FlashSectorType(adapter);
+    if(sector==NULL)
+    {
+        return FlashError(adapter, "flash has no erase command");
+    }
+
+    if(length==0)
+    {
+        return TCL_OK;
+    }
+
+    start = address & ~(sector->size-1);
+    end = (uint32)(((uint64)address + length + sector->size - 1) & ~(uint64)(sector->size-1)) - 1;
+    count = (int)(((uint64)end - start + 1) / sector->size);
+
+    // the flash may have been swapped since the last run
+    adapter->flash.unique_id_read = false;
+    LoadFlashIndex(adapter, sector->size, &index);
+
+    known.resize(count);
+    current.resize(count);
+    for(i=0; i<count; i++)
+    {
+        block = start + i*sector->size;
+        it = index.find(block);
+        known[i] = cache && (it!=index.end()) && (block>=address) && ((uint64)block+sector->size <= (uint64)address+length);
+        current[i] = known[i] ? it->second : 0;
+    }
+
+    // read back the runs of sectors not in the index
+    image.resize((size_t)count * sector->size);
+    for(i=0; i<count; i=first)
+    {
+        for(; (i<count) && known[i]; i++);
+        for(first=i; (first<count) && !known[first]; first++);
+        if( (first>i) && (FlashRead(adapter, start + i*sector->size, &image[(size_t)i*sector->size], (first-i)*sector->size, FLASH_READ_AUTO)!=TCL_OK) )
+        {
+            return TCL_ERROR;
+        }
+    }
+    debug("Info: %s, %d of %d sector(s) from the index.\n", adapter->name.c_str(), (int)std::count(known.begin(), known.end(), 1), count);
+
+    erased.assign(sector->size, 0xff);
+    blank_hash = FlashHash(&erased[0], sector->size);
+
+    hashes.resize(count);
+    blank.resize(count);
+    ParallelFor(count, [&](int n)
+    {
+        if(!known[n])
+        {
+            current[n] = FlashHash(&image[(size_t)n * sector->size], sector->size);
+        }
+        blank[n] = known[n] ? (current[n]==blank_hash) : FlashBlank(&image[(size_t)n * sector->size], sector->size);
+    });
+
+    memcpy(&image[address-start], data, length);
+    ParallelFor(count, [&](int n)
+    {
+        hashes[n] = FlashHash(&image[(size_t)n * sector->size], sector->size);
+    });
+
+    if(FlashProgramMode(adapter, mode, &quad)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    // erase each run of changed sectors as planned, but the blank ones,
+    // then program it
+    FlashIndexInvalidate(adapter, true);
+    changed.resize(count);
+    for(i=0; i<count; i++)
+    {
+        changed[i] = (current[i]!=hashes[i]);
+    }
+    for(i=0; i<count; i=first)
+    {
+        for(; (i<count) && (current[i]==hashes[i]); i++)
+        {
+            *skipped += sector->size;
+        }
+        for(first=i; (first<count) && (current[first]!=hashes[first]); first++);
+        if(first==i)
+        {
+            continue;
+        }
+
+        for(j=i; j<first; j=last)
+        {
+            for(; (j<first) && blank[j]; j++);
+            for(last=j; (last<first) && !blank[last]; last++);
+            if( (last>j) && (FlashEraseBlocks(adapter, start + j*sector->size, start + (uint64)last*sector->size, false)!=TCL_OK) )
+            {
+                return TCL_ERROR;
+            }
+        }
+
+        if(FlashProgramPages(adapter, start + i*sector->size, &image[(size_t)i*sector->size], (first-i)*sector->size, quad, elided)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        *written += (uint64)(first-i)*sector->size;
+    }
+
+    if(FlashUniqueId(adapter).empty())
+    {
+        return TCL_OK;
+    }
+
+    // the hashes of the programmed sectors are taken from the read back,
+    // into image, which is no longer needed
+    for(i=0; i<count; i=first)
+    {
+        for(; (i<count) && !changed[i]; i++);
+        for(first=i; (first<count) && changed[first]; first++);
+        if( (first>i) && (FlashRead(adapter, start + i*sector->size, &image[(size_t)i*sector->size], (first-i)*sector->size, FLASH_READ_AUTO)!=TCL_OK) )
+        {
+            return TCL_ERROR;
+        }
+    }
+    ParallelFor(count, [&](int n)
+    {
+        if(changed[n])
+        {
+            current[n] = FlashHash(&image[(size_t)n * sector->size], sector->size);
+        }
+    });
+
+    for(i=0; i<count; i++)
+    {
+        if(current[i]!=hashes[i])
+        {
+            return FlashError(adapter, "sector 0x%x reads back different after program", start + i*sector->size);
+        }
+        index[start + i*sector->size] = current[i];
+    }
+    SaveFlashIndex(adapter, sector->size, index);
+
+    return TCL_OK;
+}
+
+int FlashVerify(Adapter *adapter, uint32 address, const unsigned char *data, int length)
+{
+    std::vector <unsigned char> buffer(FLASH_VERIFY_SIZE);
+    int offset;
+    int size;
+    int i;
+
+    for(offset=0; offset<length; offset+=size)
+    {
+        size = std::min(length-offset, FLASH_VERIFY_SIZE);
+        if(FlashRead(adapter, address+offset, &buffer[0], size, FLASH_READ_AUTO)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+
+        if(memcmp(&buffer[0], data+offset, size)!=0)
+        {
+            for(i=0; buffer[i]==data[offset+i]; i++);
+            return FlashError(adapter, "verify failed at 0x%06x, read 0x%02x, expect 0x%02x", address+offset+i, buffer[i], data[offset+i]);
+        }
+    }
+
+    return TCL_OK;
+}
+
+//
+// buffer ring
+//
+// A bounded ring of reusable buffers handed along a chain of stages, each
+// on a thread of its own. A stage takes a slot after the stage before it
+// has put it back, and the first stage refills a slot once the last stage
+// is done with it, so the stages overlap, and one waits on another only
+// when the ring is full or empty. The slot with last set ends the stream.
+// busy is the time each stage spent working, not waiting, for its MB/s.
+//
+struct RingSlot
+{
+    std::vector <unsigned char> data;
+    uint32 address;
+    int length;
+    bool last;
+    // the offsets of the page program frames in data, and the end of the
+    // last one, and the count of blank pages left out, for a program stream
+    std::vector <int> frames;
+    int elided;
+};
+
+struct BufferRing
+{
+    std::vector <RingSlot> slots;
+    std::vector <uint64> done;
+    std::vector <double> busy;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool aborted;
+    std::string error;
+
+    BufferRing(int count, int size, int stages) : slots(count), done(stages, 0), busy(stages, 0), aborted(false)
+    {
+        for(int i=0; i<count; i++)
+        {
+            slots[i].data.resize(size);
+        }
+    }
+
+    // the next slot of the stage, or NULL once the ring is aborted
+    RingSlot* Take(int stage)
+    {
+        std::unique_lock <std::mutex> lock(mutex);
+
+        cond.wait(lock, [&]()
+        {
+            return aborted || ( (stage==0) ? (done[0]-done.back() < slots.size()) : (done[stage] < done[stage-1]) );
+        });
+        return aborted ? NULL : &slots[done[stage] % slots.size()];
+    }
+
+    void Put(int stage, double seconds)
+    {
+        std::lock_guard <std::mutex> lock(mutex);
+        done[stage]++;
+        busy[stage] += seconds;
+        cond.notify_all();
+    }
+
+    // stops every stage, keeping the first error
+    void Abort(const std::string &message)
+    {
+        std::lock_guard <std::mutex> lock(mutex);
+        if(!aborted)
+        {
+            error = message;
+        }
+        aborted = true;
+        cond.notify_all();
+    }
+};
+
+double SecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration <double> (std::chrono::steady_clock::now()-start).count();
+}
+
+double MBps(uint64 bytes, double seconds)
+{
+    return (seconds>0) ? (double)bytes/seconds/1000000 : 0.0;
+}
+
+struct FlashDumpStats
+{
+    uint64 bytes;
+    uint64 hash;
+    uint64 erased;
+    double seconds;
+    double read_seconds;
+    double hash_seconds;
+    double write_seconds;
+};
+
+// fopen of a Tcl file name, e.g. with ~
+FILE* OpenFileObj(Tcl_Interp *interp, Tcl_Obj *nameObj, const char *mode)
+{
+    Tcl_DString buffer;
+    const char *path;
+    FILE *fp;
+
+    path = Tcl_TranslateFileName(interp, Tcl_GetString(nameObj), &buffer);
+    if(path==NULL)
+    {
+        return NULL;
+    }
+
+    fp = fopen(path, mode);
+    Tcl_DStringFree(&buffer);
+    return fp;
+}
+
+// makes the file length bytes long, so a hole at the end is kept
+int ResizeFile(FILE *fp, uint64 length)
+{
+    if(fflush(fp)!=0)
+    {
+        return -1;
+    }
+#ifdef _WIN32
+    return _chsize_s(_fileno(fp), length);
+#else
+    return ftruncate(fileno(fp), (off_t)length);
+#endif
+}
+
+// Reads the range to fp through a ring of FLASH_DUMP_SLOTS buffers. The
+// reader is the calling thread, which owns the adapter, and the hasher, if
+// any, and the writer have threads of their own, so the USB reads never
+// wait on the disk unless the ring is full.
+// With sparse, the writer seeks over the erased 4KB blocks, leaving holes
+// in the file, which the file system doesn't store and which read as 0x00.
+// With ranges, it collects the ranges not erased, in flash addresses.
+int FlashDump(Adapter *adapter, uint32 address, int length, int mode, FILE *fp, bool hash, bool sparse,
+              std::vector < std::pair <uint32, uint32> > *ranges, FlashDumpStats *stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point t;
+    int writer = hash ? 2 : 1;
+    BufferRing ring(FLASH_DUMP_SLOTS, FLASH_DUMP_CHUNK, writer+1);
+    std::vector <std::thread> threads;
+    RingSlot *slot;
+    bool read_failed = false;
+    int offset;
+    int size;
+    int i;
+
+    if(FlashCheckRange(adapter, address, length)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    stats->hash = FLASH_HASH_SEED;
+    stats->erased = 0;
+    if(hash)
+    {
+        threads.push_back(std::thread([&]()
+        {
+            RingSlot *slot;
+            std::chrono::steady_clock::time_point t;
+            bool last;
+
+            while( (slot=ring.Take(1)) != NULL )
+            {
+                t = std::chrono::steady_clock::now();
+                stats->hash = FlashHash(&slot->data[0], slot->length, stats->hash);
+                last = slot->last;
+                ring.Put(1, SecondsSince(t));
+                if(last)
+                {
+                    break;
+                }
+            }
+        }));
+    }
+
+    threads.push_back(std::thread([&]()
+    {
+        RingSlot *slot;
+        std::chrono::steady_clock::time_point t;
+        bool scan = sparse || (ranges!=NULL);
+        bool hole = false;
+        char message[64];
+        bool last;
+        int pos;
+        int size;
+
+        while( (slot=ring.Take(writer)) != NULL )
+        {
+            t = std::chrono::steady_clock::now();
+            for(pos=0; pos<slot->length; pos+=size)
+            {
+                // erased 4KB blocks of the flash are seeked over, or left
+                // out of the ranges
+                size = scan ? std::min(slot->length-pos, FLASH_SECTOR_SIZE - (int)((slot->address+pos) % FLASH_SECTOR_SIZE)) : slot->length-pos;
+                if( scan && (size==FLASH_SECTOR_SIZE) && FlashBlank(&slot->data[pos], size) )
+                {
+                    stats->erased += size;
+                    if(sparse)
+                    {
+                        hole = true;
+                        continue;
+                    }
+                }
+                else if(ranges!=NULL)
+                {
+                    if( !ranges->empty() && (ranges->back().first+ranges->back().second==slot->address+pos) )
+                    {
+                        ranges->back().second += size;
+                    }
+                    else
+                    {
+                        ranges->push_back(std::make_pair(slot->address+(uint32)pos, (uint32)size));
+                    }
+                }
+
+                if( (hole && (fseek(fp, (long)(slot->address+pos-address), SEEK_SET) != 0)) ||
+                    (fwrite(&slot->data[pos], 1, size, fp) != (size_t)size) )
+                {
+                    break;
+                }
+                hole = false;
+            }
+            if(pos<slot->length)
+            {
+                snprintf(message, sizeof(message), "dump write fails at 0x%06x", slot->address+pos);
+                ring.Abort(message);
+                break;
+            }
+            last = slot->last;
+            ring.Put(writer, SecondsSince(t));
+            if(last)
+            {
+                break;
+            }
+        }
+    }));
+
+    for(offset=0; ; offset+=size)
+    {
+        if( (slot=ring.Take(0)) == NULL )
+        {
+            break;
+        }
+
+        // chunks end on 4KB boundaries, so no erased block is split
+        size = std::min(length-offset, FLASH_DUMP_CHUNK - (int)((address+offset) % FLASH_SECTOR_SIZE));
+        t = std::chrono::steady_clock::now();
+        if(FlashRead(adapter, address+offset, &slot->data[0], size, mode)!=TCL_OK)
+        {
+            read_failed = true;
+            ring.Abort(adapter->error);
+            break;
+        }
+        slot->address = address+offset;
+        slot->length = size;
+        slot->last = (offset+size==length);
+        ring.Put(0, SecondsSince(t));
+        if(offset+size==length)
+        {
+            break;
+        }
+    }
+
+    for(i=0; i<(int)threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    if(ring.aborted)
+    {
+        return read_failed ? TCL_ERROR : FlashError(adapter, "%s", ring.error.c_str());
+    }
+
+    if( sparse && (ResizeFile(fp, length)!=0) )
+    {
+        return FlashError(adapter, "dump can't be resized to %d byte(s)", length);
+    }
+
+    stats->bytes = length;
+    stats->seconds = SecondsSince(start);
+    stats->read_seconds = ring.busy[0];
+    stats->hash_seconds = hash ? ring.busy[1] : 0;
+    stats->write_seconds = ring.busy[writer];
+    return TCL_OK;
+}
+
+// reads up to length bytes of a program stream, returns the count, 0 at the
+// end, or -1 with message set. When the reading thread is done it calls
+// the source once more with a NULL buffer, so what the source made on that
+// thread is freed there.
+typedef std::function <int(unsigned char *buffer, int length, std::string *message)> FlashSource;
+
+struct FlashStreamStats
+{
+    int elided;
+    double seconds;
+    double stage_seconds;
+    double program_seconds;
+};
+
+// Programs length bytes from source, which is read ahead on a thread of
+// its own. That thread checks each page for blank and builds the frame of
+// every other page, header and data, into the slots of a ring, so the
+// calling thread, which owns the adapter, sends the next frame as soon as
+// WIP of the last one clears. The range is erased first as erase says,
+// while the first slots are staged.
+int FlashProgramStream(Adapter *adapter, uint32 address, int length, const FlashSource &source, int erase, int mode, FlashStreamStats *stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point t;
+    BufferRing ring(FLASH_PREFETCH_SLOTS, 0, 2);
+    std::thread stager;
+    int page_size;
+    RingSlot *slot;
+    bool quad;
+    bool busy = false;
+    bool last;
+    bool failed = false;
+    size_t i;
+
+    if( (FlashCheckRange(adapter, address, length)!=TCL_OK) || (FlushPendingWrite(adapter)!=TCL_OK) ||
+        (FlashProgramMode(adapter, mode, &quad)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+    page_size = adapter->flash.page_size;
+
+    stager = std::thread([&]()
+    {
+        std::vector <unsigned char> raw(FLASH_PREFETCH_CHUNK);
+        std::chrono::steady_clock::time_point t;
+        std::string message;
+        RingSlot *slot;
+        int offset;
+        int size;
+        int page;
+        int count;
+        int n;
+        int i;
+
+        for(offset=0; ; offset+=size)
+        {
+            if( (slot=ring.Take(0)) == NULL )
+            {
+                break;
+            }
+
+            // chunks end on page boundaries, so no page is split
+            t = std::chrono::steady_clock::now();
+            size = std::min(length-offset, FLASH_PREFETCH_CHUNK - (int)((address+offset) % page_size));
+            for(count=0; count<size; count+=n)
+            {
+                if( (n=source(&raw[count], size-count, &message)) <= 0 )
+                {
+                    break;
+                }
+            }
+            if(count<size)
+            {
+                ring.Abort( (n<0) ? message : "the image ends before the length" );
+                break;
+            }
+
+            slot->data.resize(size + (size/page_size+2)*5);
+            slot->frames.clear();
+            slot->elided = 0;
+            slot->length = 0;
+            for(i=0; i<size; i+=page)
+            {
+                page = std::min(size-i, page_size - (int)((address+offset+i) % page_size));
+                if(FlashBlank(&raw[i], page))
+                {
+                    slot->elided++;
+                    continue;
+                }
+                slot->frames.push_back(slot->length);
+                slot->length += FlashPageFrame(adapter, &slot->data[slot->length], address+offset+i, &raw[i], page, quad);
+            }
+            slot->frames.push_back(slot->length);
+            slot->address = address+offset;
+            slot->last = (offset+size==length);
+            ring.Put(0, SecondsSince(t));
+            if(offset+size==length)
+            {
+                break;
+            }
+        }
+        source(NULL, 0, &message);
+    });
+
+    if( (erase!=FLASH_ERASE_NONE) && (FlashErase(adapter, address, length, erase==FLASH_ERASE_CHIP)!=TCL_OK) )
+    {
+        failed = true;
+    }
+    FlashIndexInvalidate(adapter, true);
+
+    stats->elided = 0;
+    while( !failed && ((slot=ring.Take(1)) != NULL) )
+    {
+        t = std::chrono::steady_clock::now();
+        for(i=0; i+1<slot->frames.size(); i++)
+        {
+            if( busy && (FlashWaitReady(adapter, &adapter->flash.program_timing, std::max(adapter->flash.program_max_us/1000, FLASH_PROGRAM_TIMEOUT))!=TCL_OK) )
+            {
+                failed = true;
+                break;
+            }
+            if(FlashSendPageFrame(adapter, &slot->data[slot->frames[i]], slot->frames[i+1]-slot->frames[i], quad)!=TCL_OK)
+            {
+                failed = true;
+                break;
+            }
+            busy = true;
+        }
+        stats->elided += slot->elided;
+        last = slot->last;
+        ring.Put(1, SecondsSince(t));
+        if(failed || last)
+        {
+            break;
+        }
+    }
+
+    if( !failed && busy && (FlashWaitReady(adapter, &adapter->flash.program_timing, std::max(adapter->flash.program_max_us/1000, FLASH_PROGRAM_TIMEOUT))!=TCL_OK) )
+    {
+        failed = true;
+    }
+
+    if(failed)
+    {
+        ring.Abort(adapter->error);
+    }
+    stager.join();
+
+    if(failed)
+    {
+        return TCL_ERROR;
+    }
+    if(ring.aborted)
+    {
+        return FlashError(adapter, "%s", ring.error.c_str());
+    }
+
+    stats->seconds = SecondsSince(start);
+    stats->stage_seconds = ring.busy[0];
+    stats->program_seconds = ring.busy[1];
+    return TCL_OK;
+}
+
+// a program stream from the file fp
+FlashSource FlashFileSource(FILE *fp)
+{
+    return [fp](unsigned char *buffer, int length, std::string *message) -> int
+    {
+        size_t n;
+
+        if(buffer==NULL)
+        {
+            return 0;
+        }
+
+        n = fread(buffer, 1, length, fp);
+        if( (n==0) && ferror(fp) )
+        {
+            *message = "the image can't be read";
+            return -1;
+        }
+        return (int)n;
+    };
+}
+
+// Inflates a gzip image from fp as it's read, with the zlib of Tcl. The
+// stream and its objects are made on the first read and freed on the last
+// call, both on the thread reading it, which is no Tcl thread, so its Tcl
+// data is finalized there too.
+// The stream ends with the first member, so at the end its CRC and size
+// must be the CRC and ISIZE at the end of the file, or the file has more
+// members. With whole, the stream must also end right after length bytes.
+struct GzipState
+{
+    FILE *fp;
+    Tcl_ZlibStream stream;
+    Tcl_Obj *inObj;
+    Tcl_Obj *outObj;
+    std::vector <unsigned char> input;
+    bool input_done;
+    uint32 crc;
+    uint32 isize;
+    uint32 total;
+    int length;
+    bool whole;
+};
+
+// the next bytes of the image, 0 at the end of the stream, or -1
+int GzipInflate(GzipState *state, unsigned char *buffer, int length, std::string *message)
+{
+    unsigned char *bytes;
+    size_t n;
+    int count;
+
+    // more of the file is put in only when what's in is used up
+    for(;;)
+    {
+        Tcl_SetByteArrayLength(state->outObj, 0);
+        if(Tcl_ZlibStreamGet(state->stream, state->outObj, length)!=TCL_OK)
+        {
+            *message = "the image is not valid gzip";
+            return -1;
+        }
+
+        bytes = Tcl_GetByteArrayFromObj(state->outObj, &count);
+        if(count>0)
+        {
+            memcpy(buffer, bytes, count);
+            state->total += (uint32)count;
+            return count;
+        }
+
+        // data left in the file after the first member is another member
+        if(Tcl_ZlibStreamEof(state->stream))
+        {
+            if( ((uint32)Tcl_ZlibStreamChecksum(state->stream)!=state->crc) || (state->total!=state->isize) ||
+                (!state->input_done && (fread(&state->input[0], 1, 1, state->fp)==1)) )
+            {
+                *message = "the gzip image has more than one member, which is not supported";
+                return -1;
+            }
+            return 0;
+        }
+
+        if(state->input_done)
+        {
+            *message = "the gzip image is truncated";
+            return -1;
+        }
+
+        n = fread(&state->input[0], 1, state->input.size(), state->fp);
+        if( (n==0) && ferror(state->fp) )
+        {
+            *message = "the image can't be read";
+            return -1;
+        }
+        state->input_done = (n==0);
+        if(n==0)
+        {
+            continue;
+        }
+        Tcl_SetByteArrayObj(state->inObj, &state->input[0], (int)n);
+        if(Tcl_ZlibStreamPut(state->stream, state->inObj, TCL_ZLIB_NO_FLUSH)!=TCL_OK)
+        {
+            *message = "the image is not valid gzip";
+            return -1;
+        }
+    }
+}
+
+FlashSource FlashGzipSource(FILE *fp, uint32 crc, uint32 isize, int length, bool whole)
+{
+    std::shared_ptr <GzipState> state(new GzipState());
+
+    state->fp = fp;
+    state->stream = NULL;
+    state->inObj = NULL;
+    state->outObj = NULL;
+    state->input_done = false;
+    state->crc = crc;
+    state->isize = isize;
+    state->total = 0;
+    state->length = length;
+    state->whole = whole;
+    return [state](unsigned char *buffer, int length, std::string *message) -> int
+    {
+        unsigned char extra;
+        int count;
+
+        if(buffer==NULL)
+        {
+            if(state->stream!=NULL)
+            {
+                Tcl_ZlibStreamClose(state->stream);
+                Tcl_DecrRefCount(state->inObj);
+                Tcl_DecrRefCount(state->outObj);
+                state->stream = NULL;
+                Tcl_FinalizeThread();
+            }
+            return 0;
+        }
+
+        if(state->stream==NULL)
+        {
+            if(Tcl_ZlibStreamInit(NULL, TCL_ZLIB_STREAM_INFLATE, TCL_ZLIB_FORMAT_GZIP, 0, NULL, &state->stream)!=TCL_OK)
+            {
+                state->stream = NULL;
+                *message = "the gzip stream can't be made";
+                return -1;
+            }
+            state->inObj = Tcl_NewObj();
+            Tcl_IncrRefCount(state->inObj);
+            state->outObj = Tcl_NewObj();
+            Tcl_IncrRefCount(state->outObj);
+            state->input.resize(FLASH_PREFETCH_CHUNK);
+        }
+
+        count = GzipInflate(state.get(), buffer, length, message);
+        if( (count>0) && state->whole && (state->total==(uint32)state->length) )
+        {
+            switch(GzipInflate(state.get(), &extra, 1, message))
+            {
+                case 0:
+                    break;
+                case -1:
+                    return -1;
+                default:
+                    *message = "the gzip image is longer than its ISIZE, it may have more than one member";
+                    return -1;
+            }
+        }
+        return count;
+    };
+}
+
+//
+// interleaved program
+//
+// Programs the flashes on several chip selects of one adapter. While one
+// flash is busy with an erase or a page program, the next step is sent to
+// another, so the bus doesn't wait on the write cycle of one flash. The
+// chip select is switched with FT4222_SPIMaster_Init and the ss map of the
+// target, the FT4222 has no other way, so each switch costs some USB
+// transfers. The cost of a switch is measured, and the selected flash
+// keeps the bus, page after page, until another one is due earlier by more
+// than that, so pages are grouped per flash and the switches mostly go
+// with the long erases. A busy flash is polled only when its expected
+// time is nearly up. Each flash has its own FlashConfig, swapped into
+// adapter->flash while it's selected.
+//
+struct FlashTarget
+{
+    int cs;
+    const unsigned char *data;
+    int length;
+    FlashConfig flash;
+    bool quad;
+    std::vector < std::pair <int, uint32> > erases;
+    size_t erase_index;
+    int offset;
+    int elided;
+    bool busy;
+    bool done;
+    int timeout_ms;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point due;
+    int code;
+    std::string error;
+};
+
+// re-init SPI master with the ss map, keeping the lines and mode
+int FlashSelect(Adapter *adapter, uint8 sso_map)
+{
+    FT_STATUS ftStatus;
+    int lines = adapter->config.lines;
+
+    if(adapter->config.sso_map==sso_map)
+    {
+        return TCL_OK;
+    }
+
+    adapter->config.chunk_size = 0;
+    ftStatus = FT4222_SPIMaster_Init(adapter->handle, (lines==4) ? SPI_IO_QUAD : (lines==2) ? SPI_IO_DUAL : SPI_IO_SINGLE,
+                                     adapter->config.clk_div, adapter->config.cpol, adapter->config.cpha, sso_map);
+    if(ftStatus!=FT_OK)
+    {
+        return FlashError(adapter, "FT4222_SPIMaster_Init with ss map 0x%x returns(%d), %s", sso_map, ftStatus, FT4222StatusString(ftStatus));
+    }
+
+    adapter->config.sso_map = sso_map;
+    return TCL_OK;
+}
+
+// selects the target, and swaps its FlashConfig in
+int FlashActivate(Adapter *adapter, FlashTarget **active, FlashTarget *target)
+{
+    if(*active==target)
+    {
+        return TCL_OK;
+    }
+
+    if(*active!=NULL)
+    {
+        std::swap(adapter->flash, (*active)->flash);
+        *active = NULL;
+    }
+
+    if(FlashSelect(adapter, (uint8)(1<<target->cs))!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    std::swap(adapter->flash, target->flash);
+    *active = target;
+    return TCL_OK;
+}
+
+// the target is done, with the error of the adapter if it failed
+void FlashTargetDone(Adapter *adapter, FlashTarget *target, int code)
+{
+    target->done = true;
+    target->busy = false;
+    target->code = code;
+    if(code!=TCL_OK)
+    {
+        target->error = adapter->error.empty() ? "failed" : adapter->error;
+        adapter->error.clear();
+    }
+}
+
+// probes the flash of the target, and plans its erases
+int FlashTargetPrepare(Adapter *adapter, FlashTarget *target, uint32 address, bool erase)
+{
+    std::vector < std::pair <const FlashEraseType*, uint32> > plan;
+    const FlashEraseType *sector;
+    size_t i;
+
+    adapter->flash.probed = false;
+    if( (FlashCheckRange(adapter, address, target->length)!=TCL_OK) ||
+        (FlashProgramMode(adapter, FLASH_PROGRAM_AUTO, &target->quad)!=TCL_OK) )
+    {
+        return TCL_ERROR;
+    }
+
+    sector = FlashSectorType(adapter);
+    if( erase && (target->length>0) )
+    {
+        if(sector==NULL)
+        {
+            return FlashError(adapter, "flash has no erase command");
+        }
+
+        FlashErasePlan(adapter, address & ~(sector->size-1),
+                       ((uint64)address + target->length + sector->size - 1) & ~(uint64)(sector->size-1), false, &plan);
+        for(i=0; i<plan.size(); i++)
+        {
+            target->erases.push_back(std::make_pair((int)(plan[i].first-adapter->flash.erase_types), plan[i].second));
+        }
+    }
+
+    FlashIndexInvalidate(adapter, true);
+    return TCL_OK;
+}
+
+// sends the next erase or page program of the active target, with the
+// time its status is due to be polled
+int FlashTargetStep(Adapter *adapter, FlashTarget *target, uint32 address)
+{
+    const FlashEraseType *type;
+    const FlashTiming *timing;
+    long long expected_us;
+    int size;
+
+    while( (target->erase_index==target->erases.size()) && (target->offset<target->length) )
+    {
+        size = std::min(target->length-target->offset, (int)(adapter->flash.page_size - (address+target->offset) % adapter->flash.page_size));
+        if(!FlashBlank(target->data+target->offset, size))
+        {
+            break;
+        }
+        target->offset += size;
+        target->elided++;
+    }
+
+    if(target->erase_index<target->erases.size())
+    {
+        type = &adapter->flash.erase_types[target->erases[target->erase_index].first];
+        if(FlashStartBlockErase(adapter, type, target->erases[target->erase_index].second)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        target->erase_index++;
+        timing = &adapter->flash.erase_timing[type-adapter->flash.erase_types];
+        target->timeout_ms = std::max(type->max_ms, FLASH_ERASE_TIMEOUT);
+    }
+    else if(target->offset<target->length)
+    {
+        size = std::min(target->length-target->offset, (int)(adapter->flash.page_size - (address+target->offset) % adapter->flash.page_size));
+        if(FlashStartPageProgram(adapter, address+target->offset, target->data+target->offset, size, target->quad)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        target->offset += size;
+        timing = &adapter->flash.program_timing;
+        target->timeout_ms = std::max(adapter->flash.program_max_us/1000, FLASH_PROGRAM_TIMEOUT);
+    }
+    else
+    {
+        target->done = true;
+        return TCL_OK;
+    }
+
+    expected_us = timing->learned_us ? timing->learned_us : timing->typical_us;
+    target->busy = true;
+    target->started = std::chrono::steady_clock::now();
+    target->due = target->started + std::chrono::microseconds(expected_us*9/10);
+    return TCL_OK;
+}
+
+// polls the active target, busy or not
+int FlashTargetPoll(Adapter *adapter, FlashTarget *target)
+{
+    std::chrono::steady_clock::time_point now;
+    unsigned char tx = 0x05;
+    unsigned char status;
+
+    if(FlashTransfer(adapter, &tx, 1, &status, 1)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    now = std::chrono::steady_clock::now();
+    if((status & 0x01)==0)
+    {
+        target->busy = false;
+        target->due = now;
+    }
+    else if(now-target->started > std::chrono::milliseconds(target->timeout_ms))
+    {
+        return FlashError(adapter, "flash busy for more than %d ms, status 0x%02x", target->timeout_ms, status);
+    }
+    else
+    {
+        target->due = now + std::chrono::microseconds(FLASH_POLL_MAX_US/4);
+    }
+
+    return TCL_OK;
+}
+
+struct FlashInterleaveStats
+{
+    int switches;
+    double switch_seconds;
+};
+
+// selects the target, counting the time of a chip select switch
+int FlashSwitch(Adapter *adapter, FlashTarget **active, FlashTarget *target, FlashInterleaveStats *stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int code;
+
+    if(*active==target)
+    {
+        return TCL_OK;
+    }
+
+    code = FlashActivate(adapter, active, target);
+    stats->switches++;
+    stats->switch_seconds += SecondsSince(start);
+    return code;
+}
+
+// erases and programs every target at address, then verifies it. With
+// sequential, each target is done before the next is selected, to measure
+// against.
+int FlashInterleave(Adapter *adapter, uint32 address, std::vector <FlashTarget> &targets, bool erase, bool verify, bool sequential,
+                    FlashInterleaveStats *stats)
+{
+    FlashConfig saved = adapter->flash;
+    uint8 sso_map = adapter->config.sso_map;
+    FlashTarget *active = NULL;
+    FlashTarget *target;
+    std::chrono::steady_clock::time_point now;
+    std::chrono::microseconds cost;
+    int remaining = 0;
+    int code;
+    size_t i;
+
+    stats->switches = 0;
+    stats->switch_seconds = 0;
+
+    if(FlushPendingWrite(adapter)!=TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    if(sso_map==0)
+    {
+        return FlashError(adapter, "interleave needs spi_master_init first");
+    }
+
+    for(i=0; i<targets.size(); i++)
+    {
+        target = &targets[i];
+        target->flash = saved;
+        if( (FlashSwitch(adapter, &active, target, stats)!=TCL_OK) || (FlashTargetPrepare(adapter, target, address, erase)!=TCL_OK) )
+        {
+            FlashTargetDone(adapter, target, TCL_ERROR);
+            continue;
+        }
+        remaining++;
+    }
+
+    // the target due first takes the next step, the others can't start
+    // before a switch from now, so the active one keeps the bus unless
+    // it's busy for longer than a switch. Sequential never switches while
+    // the active one is on.
+    auto due = [&](FlashTarget *t) -> std::chrono::steady_clock::time_point
+    {
+        return (t==active) ? t->due : std::max(t->due, now) + cost;
+    };
+    while(remaining>0)
+    {
+        now = std::chrono::steady_clock::now();
+        cost = sequential ? std::chrono::microseconds(std::chrono::hours(1)) :
+               std::chrono::microseconds( (stats->switches>0) ? (int)(stats->switch_seconds*1000000/stats->switches) : 0 );
+        target = NULL;
+        for(i=0; i<targets.size(); i++)
+        {
+            if( !targets[i].done && ((target==NULL) || (due(&targets[i])<due(target))) )
+            {
+                target = &targets[i];
+            }
+        }
+
+        now = std::chrono::steady_clock::now();
+        if(target->due-now >= std::chrono::microseconds(FLASH_SLEEP_MIN_US))
+        {
+            std::this_thread::sleep_until(target->due);
+        }
+
+        code = FlashSwitch(adapter, &active, target, stats);
+        if( (code==TCL_OK) && target->busy )
+        {
+            code = FlashTargetPoll(adapter, target);
+        }
+        if( (code==TCL_OK) && !target->busy )
+        {
+            code = FlashTargetStep(adapter, target, address);
+        }
+
+        if( (code!=TCL_OK) || target->done )
+        {
+            FlashTargetDone(adapter, target, code);
+            remaining--;
+        }
+    }
+
+    for(i=0; verify && (i<targets.size()); i++)
+    {
+        target = &targets[i];
+        if( (target->code==TCL_OK) &&
+            ((FlashSwitch(adapter, &active, target, stats)!=TCL_OK) || (FlashVerify(adapter, address, target->data, target->length)!=TCL_OK)) )
+        {
+            FlashTargetDone(adapter, target, TCL_ERROR);
+        }
+    }
+
+    if(active!=NULL)
+    {
+        std::swap(adapter->flash, active->flash);
+    }
+    adapter->flash = saved;
+    return FlashSelect(adapter, sso_map);
+}
+
+//
+// tcl command 
+//
+
+int do_adapter_command(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+void StopWorker(Adapter *adapter);
+
+// called when an adapter command is deleted, by adapter_close or at exit
+void DeleteAdapter(ClientData clientData)
+{
+    Adapter *adapter = (Adapter*)clientData;
+
+    StopWorker(adapter);
+    if(adapter->handle!=NULL)
+    {
+        FT_Close(adapter->handle);
+    }
+
+    OpenAdapters.erase(std::remove(OpenAdapters.begin(), OpenAdapters.end(), adapter), OpenAdapters.end());
+    if(CurrentAdapter==adapter)
+    {
+        CurrentAdapter = OpenAdapters.empty() ? &DefaultAdapter : OpenAdapters.back();
+    }
+
+    debug("Info: %s deleted.\n", adapter->name.c_str());
+    delete adapter;
+}
+
+int do_adapter_list(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    if (objc != 1)
+    {
+        printf("Error: adapter_list accepts no parameter.\n");
+        return TCL_ERROR;
+    }
+
+    // detect
+    DetectAdapters();
+    if(AdapterList.size()==0)
+    {
+        printf("Error: no adapter detect.\n");
+        return TCL_ERROR;
+    }
+
+    PrintAdapters();
+
+    return TCL_OK;
+}
+
+int do_adapter_open(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    FT_STATUS ftStatus;
+    DWORD locID;
+    int adapter_index;
+    Adapter *adapter;
+    char name[32];
+
+    if (objc != 2)
+    {
+        printf("Error: adapter_open <adapter_index>.\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &adapter_index) != TCL_OK)
+    {
+        printf("Error: <adapter_index> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    if(AdapterList.size()==0)
+    {
+        DetectAdapters();
+    }
+
+    if( (adapter_index<0) || (adapter_index>=(int)AdapterList.size()) )
+    {
+        printf("Error: adapter number %d, is beyond available range %ld, use --list or list_adapter to show available adapters.\n", adapter_index, (long)AdapterList.size()-1);
+        return TCL_ERROR;
+    }
+
+    // clock settings done before adapter_open apply to the new adapter
+    adapter = new Adapter();
+    adapter->index = adapter_index;
+    adapter->config.frequency = DefaultAdapter.config.frequency;
+    adapter->config.real_freq = DefaultAdapter.config.real_freq;
+    adapter->config.sys_clk = DefaultAdapter.config.sys_clk;
+    adapter->config.clk_div = DefaultAdapter.config.clk_div;
+    adapter->config.coalesce = DefaultAdapter.config.coalesce;
+
+    locID = AdapterList[adapter_index].LocId;
+    ftStatus = FT_OpenEx((PVOID)(uintptr_t)locID, FT_OPEN_BY_LOCATION, &adapter->handle);
+    if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT_OpenEX returns(%d), unknown error.\n", ftStatus);
+        delete adapter;
+        return TCL_ERROR;
+    }
+
+    snprintf(name, sizeof(name), "adapter%d", AdapterCounter++);
+    adapter->name = name;
+    adapter->token = Tcl_CreateObjCommand(interp, name, do_adapter_command, (ClientData)adapter, DeleteAdapter);
+    OpenAdapters.push_back(adapter);
+    CurrentAdapter = adapter;
+
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(name, -1));
+
+    debug("Info: adapter_open %d as %s, done.\n", adapter_index, name);
+
+    return TCL_OK;
+}
+
+int do_adapter_close(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+
+    if (objc != 1)
+    {
+        printf("Error: adapter_close accepts no parameter.\n");
+        return TCL_ERROR;
+    }
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT_Close(adapter->handle);
+    if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT_Close returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else
+    {
+        debug("Info: adapter_close, done.\n");
+    }
+
+    adapter->handle = NULL;
+    if(adapter!=&DefaultAdapter)
+    {
+        Tcl_DeleteCommandFromToken(interp, adapter->token);
+    }
+
+    return TCL_OK;
+}
+
+int do_adapter_uninitialize(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+
+    if (objc != 1)
+    {
+        printf("Error: adapter_uninitialize accepts no parameter.\n");
+        return TCL_ERROR;
+    }
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT4222_UnInitialize(adapter->handle);
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_UnInitialize returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_UnInitialize returns(%d), unknown error.\n", ftStatus);
+    }
+    else
+    {
+        debug("Info: adapter_uninitialize, done.\n");
+    }
+
+    return TCL_OK;
+}
+
+
+int do_adapter_frequency(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    DWORD locID;
+    FT4222_ClockRate sys_clk;
+    FT4222_SPIClock clk_div;
+    int freq;
+    int real_freq;
+
+    if (objc != 2)
+    {
+        printf("Error: adapter_frequency <kHz>.\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &freq) != TCL_OK)
+    {
+        printf("Error: <kHz> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    freq = freq*1000;
+
+    // sck lookup table
+    //
+    //  sck         sys_clk     clk_div
+    //   46.875K    24MHz       div_512
+    //   93.75K     48MHz       div_512
+    //   117.18K    60MHz       div_512
+    //   156.25K    80MHz       div_512
+    //   187.5K     48MHz       div_256
+    //   234.375K   60MHz       div_256
+    //   312.5K     80MHz       div_256
+    //   375K       48MHz       div_128
+    //   468.75K    60MHz       div_128
+    //   625K       80MHz       div_128
+    //   750K       48MHz       div_64
+    //   937.5K     60MHz       div_64
+    //   1.25M      80MHz       div_64
+    //   1.5M       48MHz       div_32
+    //   1.875M     60MHz       div_32
+    //   2.5M       80MHz       div_32
+    //   3M         48MHz       div_16
+    //   3.75M      60MHz       div_16
+    //   5M         80MHz       div_16
+    //   6M         48MHz       div_8
+    //   7.5M       60MHz       div_8
+    //   10M        80MHz       div_8
+    //   12M        48MHz       div_4
+    //   15M        60MHz       div_4
+    //   20M        80MHz       div_16(errata suggest)
+    //   24M        48MHz       div_2
+    //   30M        60MHz       div_2
+    //   40M        80MHz       div_2
+    if     (freq<   93750) {sys_clk=SYS_CLK_24; clk_div=CLK_DIV_512; real_freq=   46875;}
+    else if(freq<  117180) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_512; real_freq=   93750;}
+    else if(freq<  156250) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_512; real_freq=  117180;}
+    else if(freq<  187500) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_512; real_freq=  156250;}
+    else if(freq<  234375) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_256; real_freq=  187500;}
+    else if(freq<  312500) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_256; real_freq=  234375;}
+    else if(freq<  375000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_256; real_freq=  312500;}
+    else if(freq<  468750) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_128; real_freq=  375000;}
+    else if(freq<  625000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_128; real_freq=  468750;}
+    else if(freq<  750000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_128; real_freq=  625000;}
+    else if(freq<  937500) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_64 ; real_freq=  750000;}
+    else if(freq< 1250000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_64 ; real_freq=  937500;}
+    else if(freq< 1500000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_64 ; real_freq= 1250000;}
+    else if(freq< 1875000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_32 ; real_freq= 1500000;}
+    else if(freq< 2500000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_32 ; real_freq= 1875000;}
+    else if(freq< 3000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_32 ; real_freq= 2500000;}
+    else if(freq< 3750000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_16 ; real_freq= 3000000;}
+    else if(freq< 5000000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_16 ; real_freq= 3750000;}
+    else if(freq< 6000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_16 ; real_freq= 5000000;}
+    else if(freq< 7500000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_8  ; real_freq= 6000000;}
+    else if(freq<10000000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_8  ; real_freq= 7500000;}
+    else if(freq<12000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_8  ; real_freq=10000000;}
+    else if(freq<15000000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_4  ; real_freq=12000000;}
+    else if(freq<20000000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_4  ; real_freq=15000000;}
+    else if(freq<24000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_16 ; real_freq=20000000;}
+    else if(freq<30000000) {sys_clk=SYS_CLK_48; clk_div=CLK_DIV_2  ; real_freq=24000000;}
+    else if(freq<40000000) {sys_clk=SYS_CLK_60; clk_div=CLK_DIV_2  ; real_freq=30000000;}
+    else                   {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_2  ; real_freq=40000000;}
+
+    if(freq>=20000000 && freq<24000000) {sys_clk=SYS_CLK_80; clk_div=CLK_DIV_16 ; real_freq=5000000;}
+
+    adapter->config.sys_clk = sys_clk;
+    adapter->config.clk_div = clk_div;
+    adapter->config.frequency = freq;
+    adapter->config.real_freq = real_freq;
+
+    printf("Info: target frequency %.3fkHz, rounded to %.3fkHz.\n", (float)freq/1000, (float)real_freq/1000);
+
+    return TCL_OK;
+}
+
+
+int do_adapter_get_version(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    FT4222_Version ver;
+
+    if (objc != 1)
+    {
+        printf("Error: adapter_get_version accepts no parameter.\n");
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT4222_GetVersion(adapter->handle, &ver);
+    if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_GetVersion returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    printf("Info: chip version 0x%08x, DLL version 0x%08x.\n", ver.chipVersion, ver.dllVersion);
+
+    return TCL_OK;
+}
+
+int do_adapter_chip_reset(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+
+    if (objc != 1)
+    {
+        printf("Error: adapter_chip_reset accepts no parameter.\n");
+        return TCL_ERROR;
+    }
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT4222_ChipReset(adapter->handle);
+    if(ftStatus==FT4222_DEVICE_NOT_SUPPORTED)
+    {
+        printf("Error: FT4222_ChipReset returns(%d), FT4222_DEVICE_NOT_SUPPORTED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_ChipReset returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    debug("Info: adapter_chip_reset, done.\n");
+    return TCL_OK;
+}
+
+int do_spi_reset_transaction(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+
+    if (objc != 1)
+    {
+        printf("Error: spi_reset_transaction accepts no parameter.\n");
+        return TCL_ERROR;
+    }
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT4222_SPI_ResetTransaction(adapter->handle, 0);
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_SPI_ResetTransaction returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_INVALID_PARAMETER)
+    {
+        printf("Error: FT4222_SPI_ResetTransaction returns(%d), INVALID_PARAMETER.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPI_ResetTransaction returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    debug("Info: spi_reset_transaction, done.\n");
+    return TCL_OK;
+}
+
+int do_spi_reset(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+
+    if (objc != 1)
+    {
+        printf("Error: spi_reset accepts no parameter.\n");
+        return TCL_ERROR;
+    }
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT4222_SPI_Reset(adapter->handle);
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_SPI_Reset returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPI_Reset returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    debug("Info: spi_reset, done.\n");
+    return TCL_OK;
+}
+
+int do_spi_set_drive_strength(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    int drive_strength;
+    SPI_DrivingStrength ds;
+
+    if (objc != 2)
+    {
+        printf("Error: spi_set_drive_strength <0~3>.\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &drive_strength) != TCL_OK)
+    {
+        printf("Error: <drive_strength> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    if( (drive_strength<0) || (drive_strength>3) )
+    {
+        printf("Error: drive_strength should be 0~3.\n");
+        return TCL_ERROR;
+    }
+
+    ds =
+        (drive_strength==0) ? DS_4MA  : \
+        (drive_strength==1) ? DS_8MA  : \
+        (drive_strength==2) ? DS_12MA : \
+        (drive_strength==3) ? DS_16MA : \
+        DS_16MA;
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT4222_SPI_SetDrivingStrength(adapter->handle, ds, ds, ds);
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_SPI_SetDrivingStrength returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_IS_NOT_SPI_MODE)
+    {
+        printf("Error: FT4222_SPI_SetDrivingStrength returns(%d), FT4222_IS_NOT_SPI_MODE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPI_SetDrivingStrength returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    debug("Info: spi_set_drive_strength %d, done.\n", drive_strength);
+    return TCL_OK;
+}
+
+int do_spi_master_init(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    int lines;
+    int cpol;
+    int cpha;
+    int sso_map = 0x1;
+    FT4222_SPIMode ioLine;
+    FT4222_SPICPOL ftCPOL;
+    FT4222_SPICPHA ftCPHA;
+
+    if ( (objc != 4) && (objc != 5) )
+    {
+        printf("Error: spi_master_init <lines> <cpol> <cpha> [ss_map].\n");
+        return TCL_ERROR;
+    }
+
+    if ( (objc == 5) && ((Tcl_GetIntFromObj(interp, objv[4], &sso_map) != TCL_OK) || (sso_map < 0x1) || (sso_map > 0xf)) )
+    {
+        printf("Error: [ss_map] should be 0x1~0xf, a bit for each of SS0~SS3.\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &lines) != TCL_OK)
+    {
+        printf("Error: <lines> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[2], &cpol) != TCL_OK)
+    {
+        printf("Error: <cpol> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[3], &cpha) != TCL_OK)
+    {
+        printf("Error: <cpha> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    if( (lines!=1) && (lines!=2) && (lines!=4) )
+    {
+        printf("Error: lines should be 1/2/4.\n");
+        return TCL_ERROR;
+    }
+
+    if( (cpol!=0) && (cpol!=1) )
+    {
+        printf("Error: cpol should be 0/1.\n");
+        return TCL_ERROR;
+    }
+
+    if( (cpha!=0) && (cpha!=1) )
+    {
+        printf("Error: cpha should be 0/1.\n");
+        return TCL_ERROR;
+    }
+
+    ioLine = (lines==1) ? SPI_IO_SINGLE :(lines==2) ? SPI_IO_DUAL : (lines==4) ? SPI_IO_QUAD : SPI_IO_SINGLE;
+    ftCPOL = (cpol==0) ? CLK_IDLE_LOW : CLK_IDLE_HIGH;
+    ftCPHA = (cpha==0) ? CLK_LEADING : CLK_TRAILING;
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT4222_SetClock(adapter->handle, adapter->config.sys_clk);
+    if(ftStatus==FT4222_DEVICE_NOT_SUPPORTED)
+    {
+        printf("Error: FT4222_SetClock fail(%d), FT4222_DEVICE_NOT_SUPPORT.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SetClock fail(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    debug("Info: frequency set to %.3fkHz.\n", (float)adapter->config.real_freq/1000);
+
+    adapter->config.chunk_size = 0;
+    adapter->flash.probed = false;
+    ftStatus = FT4222_SPIMaster_Init(adapter->handle, ioLine, adapter->config.clk_div, ftCPOL, ftCPHA, (uint8)sso_map);
+    if(ftStatus==FT4222_DEVICE_NOT_SUPPORTED)
+    {
+        printf("Error: FT4222_SPIMaster_Init returns(%d), FT4222_DEVICE_NOT_SUPPORTED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_INVALID_PARAMETER)
+    {
+        printf("Error: FT4222_SPIMaster_Init returns(%d), INVALID_PARAMETER.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPIMaster_Init returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    adapter->config.lines = lines;
+    adapter->config.max_lines = lines;
+    adapter->config.cpol = ftCPOL;
+    adapter->config.cpha = ftCPHA;
+    adapter->config.sso_map = (uint8)sso_map;
+    debug("Info: spi_master_init %d %d %d 0x%x, done.\n", lines, cpol, cpha, sso_map);
+
+    return TCL_OK;
+}
+
+int do_spi_master_set_lines(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    int lines;
+    FT4222_SPIMode ioLine;
+
+    if (objc != 2)
+    {
+        printf("Error: spi_master_set_lines <lines>.\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &lines) != TCL_OK)
+    {
+        printf("Error: <lines> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    if( (lines!=1) && (lines!=2) && (lines!=4) )
+    {
+        printf("Error: lines should be 1/2/4.\n");
+        return TCL_ERROR;
+    }
+
+    ioLine = (lines==1) ? SPI_IO_SINGLE :(lines==2) ? SPI_IO_DUAL : (lines==4) ? SPI_IO_QUAD : SPI_IO_SINGLE;
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    adapter->config.chunk_size = 0;
+    ftStatus = FT4222_SPIMaster_SetLines(adapter->handle, ioLine);
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_SPIMaster_SetLines returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_IS_NOT_SPI_MODE)
+    {
+        printf("Error: FT4222_SPIMaster_SetLines returns(%d), FT4222_IS_NOT_SPI_MODE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_NOT_SUPPORTED)
+    {
+        printf("Error: FT4222_SPIMaster_SetLines returns(%d), FT4222_NOT_SUPPORTED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPIMaster_SetLines returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    adapter->config.lines = lines;
+    adapter->config.max_lines = std::max(adapter->config.max_lines, lines);
+    debug("Info: spi_master_set_lines %d, done.\n", lines);
+
+    return TCL_OK;
+}
+
+int do_spi_master_set_mode(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    int cpol;
+    int cpha;
+    FT4222_SPICPOL ftCPOL;
+    FT4222_SPICPHA ftCPHA;
+
+    if (objc != 3)
+    {
+        printf("Error: spi_master_set_mode <cpol> <cpha>.\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &cpol) != TCL_OK)
+    {
+        printf("Error: <cpol> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[2], &cpha) != TCL_OK)
+    {
+        printf("Error: <cpha> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    if( (cpol!=0) && (cpol!=1) )
+    {
+        printf("Error: cpol should be 0/1.\n");
+        return TCL_ERROR;
+    }
+
+    if( (cpha!=0) && (cpha!=1) )
+    {
+        printf("Error: cpha should be 0/1.\n");
+        return TCL_ERROR;
+    }
+
+    ftCPOL = (cpol==0) ? CLK_IDLE_LOW : CLK_IDLE_HIGH;
+    ftCPHA = (cpha==0) ? CLK_LEADING : CLK_TRAILING;
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = FT4222_SPIMaster_SetMode(adapter->handle, ftCPOL, ftCPHA);
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_SPIMaster_SetMode returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_IS_NOT_SPI_MODE)
+    {
+        printf("Error: FT4222_SPIMaster_SetMode returns(%d), FT4222_IS_NOT_SPI_MODE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_NOT_SUPPORTED)
+    {
+        printf("Error: FT4222_SPIMaster_SetMode returns(%d), FT4222_NOT_SUPPORTED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPIMaster_SetMode returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    adapter->config.cpol = ftCPOL;
+    adapter->config.cpha = ftCPHA;
+    debug("Info: spi_master_set_mode %d %d, done.\n", cpol, cpha);
+
+    return TCL_OK;
+}
+
+int do_spi_master_coalesce(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    std::string objv1_string;
+
+    if (objc != 2)
+    {
+        printf("Error: spi_master_coalesce <on|off>.\n");
+        return TCL_ERROR;
+    }
+
+    objv1_string = Tcl_GetString(objv[1]);
+    if( (objv1_string!="on") && (objv1_string!="off") )
+    {
+        printf("Error: spi_master_coalesce should be on/off.\n");
+        return TCL_ERROR;
+    }
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    adapter->config.coalesce = (objv1_string=="on");
+
+    debug("Info: spi_master_coalesce %s, done.\n", objv1_string.c_str());
+    return TCL_OK;
+}
+
+int do_spi_master_single_write(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    int i;
+    int length;
+    int array_length;
+    unsigned char* objv1_array;
+    unsigned char* tx_buffer;
+    std::string objv3_string;
+    bool cs_keep;
+    bool isEndTransaction;
+    int sizeTransferred;
+
+    if ( (objc!=3) && (objc!=4))
+    {
+        printf("Error: spi_master_single_write <write_buffer> <length> [cs_keep].\n");
+        return TCL_ERROR;
+    }
+
+    objv1_array = GetWriteBuffer(objv[1], &array_length, adapter->config.gather_buffer);
+
+    if (Tcl_GetIntFromObj(interp, objv[2], &length) != TCL_OK)
+    {
+        printf("Error: <length> should be a int number.\n");
+        return TCL_ERROR;
+    }
+    debug("Debug: length = %d\n", length);
+
+    if (length < 0)
+    {
+        printf("Error: <length> should not be negative.\n");
+        return TCL_ERROR;
+    }
+
+    tx_buffer = GetWriteData(adapter, objv1_array, array_length, length);
+    FlashScriptWrite(adapter, tx_buffer, length);
+
+    debug("Debug: tx_buffer:\n");
+    for(i=0; i<length; i++)
+    {
+        debug(" %02x", tx_buffer[i]);
+    }
+    debug("\n");
+
+    if (objc==4)
+    {
+        objv3_string = Tcl_GetString(objv[3]);
+        cs_keep = (objv3_string=="cs_keep") ? true : false; 
+    }
+    else
+        cs_keep = false;
+    debug("Debug: cs_keep = %s\n", cs_keep?"true":"false");
+    isEndTransaction = cs_keep?false:true;
+
+    if(adapter->config.coalesce)
+    {
+        adapter->config.pending.insert(adapter->config.pending.end(), tx_buffer, tx_buffer+length);
+        if(cs_keep)
+        {
+            debug("Info: spi_master_single_write, coalesced.\n");
+            return TCL_OK;
+        }
+        tx_buffer = &adapter->config.pending[0];
+        length = (int)adapter->config.pending.size();
+    }
+
+    ftStatus = SPIMaster_SingleWrite(adapter, tx_buffer, length, &sizeTransferred, isEndTransaction);
+    adapter->config.pending.clear();
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_INVALID_POINTER)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_IS_NOT_SPI_SINGLE_MODE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_IS_NOT_SPI_SINGLE_MODE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    if((int)sizeTransferred != length)
+    {
+        printf("Error: FT4222_SPIMaster_SingleWrite is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
+        return TCL_ERROR;
+    }
+
+    debug("Info: spi_master_single_write, done.\n");
+    return TCL_OK;
+}
+
+int do_spi_master_single_read(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    ReadTarget target;
+    unsigned char* rx_buffer;
+    Tcl_Obj *byteArrayObj;
+    int i;
+    int length;
+    std::string objv3_string;
+    bool cs_keep;
+    bool isEndTransaction;
+    int sizeTransferred;
+
+    if (ParseReadTarget(interp, &objc, objv, &target) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    if ( (objc!=2) && (objc!=3))
+    {
+        printf("Error: spi_master_single_read <length> [cs_keep] [-into varName [-offset N]].\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &length) != TCL_OK)
+    {
+        printf("Error: <length> should be a int number.\n");
+        return TCL_ERROR;
+    }
+    debug("Debug: length = %d\n", length);
+
+    if (length < 0)
+    {
+        printf("Error: <length> should not be negative.\n");
+        return TCL_ERROR;
+    }
+
+    if (objc==3)
+    {
+        objv3_string = Tcl_GetString(objv[2]);
+        cs_keep = (objv3_string=="cs_keep") ? true : false; 
+    }
+    else
+        cs_keep = false;
+    debug("Debug: cs_keep = %s\n", cs_keep?"true":"false");
+    isEndTransaction = cs_keep?false:true;
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    rx_buffer = NewReadResult(interp, &target, &byteArrayObj, length);
+    if (rx_buffer == NULL)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = SPIMaster_SingleRead(adapter, rx_buffer, length, &sizeTransferred, isEndTransaction);
+    if( (ftStatus!=FT_OK) || (sizeTransferred!=length) )
+    {
+        FreeReadResult(byteArrayObj);
+    }
+
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_INVALID_POINTER)
+    {
+        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_IS_NOT_SPI_SINGLE_MODE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_IS_NOT_SPI_SINGLE_MODE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    if(sizeTransferred != length)
+    {
+        printf("Error: FT4222_SPIMaster_SingleRead is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
+        return TCL_ERROR;
+    }
+
+    debug("Debug: rx_buffer:\n");
+    for(i=0; i<length; i++)
+    {
+        debug(" %02x", rx_buffer[i]);
+    }
+    debug("\n");
+
+    if (SetReadResult(interp, &target, byteArrayObj, length) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    debug("Info: spi_master_single_read, done.\n");
+    return TCL_OK;
+}
+
+int do_spi_master_single_read_write(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    ReadTarget target;
+    unsigned char* rx_buffer;
+    Tcl_Obj *byteArrayObj;
+    int i;
+    int length;
+    int array_length;
+    unsigned char* objv1_array;
+    unsigned char* tx_buffer;
+    std::string objv3_string;
+    bool cs_keep;
+    bool isEndTransaction;
+    int sizeTransferred;
+
+    if (ParseReadTarget(interp, &objc, objv, &target) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    if ( (objc!=3) && (objc!=4))
+    {
+        printf("Error: spi_master_single_read_write <write_buffer> <length> [cs_keep] [-into varName [-offset N]].\n");
+        return TCL_ERROR;
+    }
+
+    objv1_array = GetWriteBuffer(objv[1], &array_length, adapter->config.gather_buffer);
+
+    if (Tcl_GetIntFromObj(interp, objv[2], &length) != TCL_OK)
+    {
+        printf("Error: <length> should be a int number.\n");
+        return TCL_ERROR;
+    }
+    debug("Debug: length = %d\n", length);
+
+    if (length < 0)
+    {
+        printf("Error: <length> should not be negative.\n");
+        return TCL_ERROR;
+    }
+
+    tx_buffer = GetWriteData(adapter, objv1_array, array_length, length);
+    FlashScriptWrite(adapter, tx_buffer, length);
+
+    debug("Debug: tx_buffer:\n");
+    for(i=0; i<length; i++)
+    {
+        debug(" %02x", tx_buffer[i]);
+    }
+    debug("\n");
+
+    if (objc==4)
+    {
+        objv3_string = Tcl_GetString(objv[3]);
+        cs_keep = (objv3_string=="cs_keep") ? true : false; 
+    }
+    else
+        cs_keep = false;
+    debug("Debug: cs_keep = %s\n", cs_keep?"true":"false");
+    isEndTransaction = cs_keep?false:true;
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    rx_buffer = NewReadResult(interp, &target, &byteArrayObj, length);
+    if (rx_buffer == NULL)
+    {
+        return TCL_ERROR;
+    }
+
+    ftStatus = SPIMaster_SingleReadWrite(adapter, rx_buffer, tx_buffer, length, &sizeTransferred, isEndTransaction);
+    if( (ftStatus!=FT_OK) || ((int)sizeTransferred!=length) )
+    {
+        FreeReadResult(byteArrayObj);
+    }
+
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    {
+        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_INVALID_POINTER)
+    {
+        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_IS_NOT_SPI_SINGLE_MODE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_IS_NOT_SPI_SINGLE_MODE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+    {
+        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    if((int)sizeTransferred != length)
+    {
+        printf("Error: FT4222_SPIMaster_SingleReadWrite is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
+        return TCL_ERROR;
+    }
+
+    debug("Debug: rx_buffer:\n");
+    for(i=0; i<length; i++)
+    {
+        debug(" %02x", rx_buffer[i]);
+    }
+    debug("\n");
+
+    if (SetReadResult(interp, &target, byteArrayObj, length) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    debug("Info: spi_master_single_read_write, done.\n");
+    return TCL_OK;
 }
 
-int do_spi_reset_transaction(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
-{
-    if (objc != 1)
+int do_spi_master_multi_read_write(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    ReadTarget target;
+    unsigned char* rx_buffer;
+    Tcl_Obj *byteArrayObj;
+    int i;
+    int single_write_length;
+    int multi_write_length;
+    int multi_read_length;
+    int array_length;
+    unsigned char* objv1_array;
+    unsigned char* tx_buffer;
+    uint32_t sizeRead;
+    int write_length;
+
+    if (ParseReadTarget(interp, &objc, objv, &target) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    if (objc!=5)
+    {
+        printf("Error: spi_master_multi_read_write <write_buffer> <single_write_length> <multi_write_length> <multi_read_length> [-into varName [-offset N]].\n");
+        return TCL_ERROR;
+    }
+
+    objv1_array = GetWriteBuffer(objv[1], &array_length, adapter->config.gather_buffer);
+
+    if (Tcl_GetIntFromObj(interp, objv[2], &single_write_length) != TCL_OK)
+    {
+        printf("Error: <single_write_length> should be a int number.\n");
+        return TCL_ERROR;
+    }
+    debug("Debug: single_write_length = %d\n", single_write_length);
+
+    if (Tcl_GetIntFromObj(interp, objv[3], &multi_write_length) != TCL_OK)
+    {
+        printf("Error: <multi_write_length> should be a int number.\n");
+        return TCL_ERROR;
+    }
+    debug("Debug: multi_write_length = %d\n", multi_write_length);
+
+    if (Tcl_GetIntFromObj(interp, objv[4], &multi_read_length) != TCL_OK)
+    {
+        printf("Error: <multi_read_length> should be a int number.\n");
+        return TCL_ERROR;
+    }
+    debug("Debug: multi_read_length = %d\n", multi_read_length);
+
+    // every FT4222_SPIMaster_MultiReadWrite call is a CS frame of its own,
+    // so a multi line transfer can not be chunked
+    if( (single_write_length<0) || (single_write_length>0xFF) )
+    {
+        printf("Error: <single_write_length> should be 0~255.\n");
+        return TCL_ERROR;
+    }
+
+    if( (multi_write_length<0) || (multi_write_length>0xFFFF) )
+    {
+        printf("Error: <multi_write_length> should be 0~65535.\n");
+        return TCL_ERROR;
+    }
+
+    if( (multi_read_length<0) || (multi_read_length>0xFFFF) )
+    {
+        printf("Error: <multi_read_length> should be 0~65535.\n");
+        return TCL_ERROR;
+    }
+
+    write_length = single_write_length+multi_write_length;
+
+    tx_buffer = GetWriteData(adapter, objv1_array, array_length, write_length);
+    FlashScriptWrite(adapter, tx_buffer, write_length);
+
+    debug("Debug: tx_buffer:\n");
+    for(i=0; i<write_length; i++)
+    {
+        debug(" %02x", tx_buffer[i]);
+    }
+    debug("\n");
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    rx_buffer = NewReadResult(interp, &target, &byteArrayObj, multi_read_length);
+    if (rx_buffer == NULL)
     {
-        printf("Error: spi_reset_transaction accepts no parameter.\n");
         return TCL_ERROR;
     }
 
-    ftStatus = FT4222_SPI_ResetTransaction(ftHandle, 0);
+    ftStatus = FT4222_SPIMaster_MultiReadWrite
+    (
+        adapter->handle,
+        rx_buffer,
+        tx_buffer,
+        (uint8)single_write_length,
+        (uint16_t)multi_write_length,
+        (uint16_t)multi_read_length,
+        &sizeRead
+    );
+    if( (ftStatus!=FT_OK) || ((int)sizeRead!=multi_read_length) )
+    {
+        FreeReadResult(byteArrayObj);
+    }
+
     if(ftStatus==FT4222_DEVICE_NOT_OPENED)
     {
-        printf("Error: FT4222_SPI_ResetTransaction returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_INVALID_PARAMETER)
+    else if(ftStatus==FT4222_INVALID_POINTER)
     {
-        printf("Error: FT4222_SPI_ResetTransaction returns(%d), INVALID_PARAMETER.\n", ftStatus);
+        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+    {
+        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+    {
+        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
         return TCL_ERROR;
     }
     else if(ftStatus!=FT_OK)
     {
-        printf("Error: FT4222_SPI_ResetTransaction returns(%d), unknown error.\n", ftStatus);
+        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
 
-    debug("Info: spi_reset_transaction, done.\n");
+    if((int)sizeRead != multi_read_length)
+    {
+        printf("Error: FT4222_SPIMaster_MultiReadWrite is required to read %d byte(s), but actually read %d byte(s).\n", multi_read_length, sizeRead);
+        return TCL_ERROR;
+    }
+
+    debug("Debug: rx_buffer:\n");
+    for(i=0; i<multi_read_length; i++)
+    {
+        debug(" %02x", rx_buffer[i]);
+    }
+    debug("\n");
+
+    if (SetReadResult(interp, &target, byteArrayObj, multi_read_length) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    debug("Info: spi_master_multi_read_write, done.\n");
     return TCL_OK;
 }
 
-int do_spi_reset(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+//
+// spi_master_transaction
+//
+// A list of segments is run in one Tcl command. Single line segments share
+// one CS window, which is only closed by cs_release, by a segment that needs
+// a CS frame of its own (multi, lines), or at the end of the list.
+//
+enum SpiSegmentType
 {
-    if (objc != 1)
+    SEGMENT_WRITE,
+    SEGMENT_READ,
+    SEGMENT_READ_WRITE,
+    SEGMENT_MULTI,
+    SEGMENT_LINES,
+    SEGMENT_CS_RELEASE,
+};
+
+struct SpiSegment
+{
+    SpiSegmentType type;
+    unsigned char* array;
+    int array_length;
+    int length;
+    int single_write_length;
+    int multi_write_length;
+    int read_length;
+    int lines;
+    bool isEndTransaction;
+};
+
+int ParseSpiSegment(Tcl_Interp *interp, Tcl_Obj *segmentObj, SpiSegment *segment, std::vector <unsigned char> &gather)
+{
+    int objc;
+    Tcl_Obj **objv;
+    std::string type;
+
+    if (Tcl_ListObjGetElements(interp, segmentObj, &objc, &objv) != TCL_OK || objc<1)
     {
-        printf("Error: spi_reset accepts no parameter.\n");
+        printf("Error: segment should be a list of <type> [args].\n");
         return TCL_ERROR;
     }
 
-    ftStatus = FT4222_SPI_Reset(ftHandle);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    memset(segment, 0, sizeof(SpiSegment));
+    type = Tcl_GetString(objv[0]);
+
+    if( (type=="write") || (type=="read_write") )
     {
-        printf("Error: FT4222_SPI_Reset returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        if( (objc!=2) && (objc!=3) )
+        {
+            printf("Error: segment %s <write_buffer> [length].\n", type.c_str());
+            return TCL_ERROR;
+        }
+        segment->type = (type=="write") ? SEGMENT_WRITE : SEGMENT_READ_WRITE;
+        segment->array = GetWriteBuffer(objv[1], &segment->array_length, gather);
+        segment->length = segment->array_length;
+        if( (objc==3) && (Tcl_GetIntFromObj(interp, objv[2], &segment->length)!=TCL_OK) )
+        {
+            printf("Error: <length> should be a int number.\n");
+            return TCL_ERROR;
+        }
+        if(segment->type==SEGMENT_READ_WRITE)
+        {
+            segment->read_length = segment->length;
+        }
+    }
+    else if(type=="read")
+    {
+        if(objc!=2)
+        {
+            printf("Error: segment read <length>.\n");
+            return TCL_ERROR;
+        }
+        segment->type = SEGMENT_READ;
+        if (Tcl_GetIntFromObj(interp, objv[1], &segment->length) != TCL_OK)
+        {
+            printf("Error: <length> should be a int number.\n");
+            return TCL_ERROR;
+        }
+        segment->read_length = segment->length;
+    }
+    else if(type=="multi")
+    {
+        if(objc!=5)
+        {
+            printf("Error: segment multi <write_buffer> <single_write_length> <multi_write_length> <multi_read_length>.\n");
+            return TCL_ERROR;
+        }
+        segment->type = SEGMENT_MULTI;
+        segment->array = GetWriteBuffer(objv[1], &segment->array_length, gather);
+        if( (Tcl_GetIntFromObj(interp, objv[2], &segment->single_write_length) != TCL_OK) ||
+            (Tcl_GetIntFromObj(interp, objv[3], &segment->multi_write_length) != TCL_OK) ||
+            (Tcl_GetIntFromObj(interp, objv[4], &segment->read_length) != TCL_OK) )
+        {
+            printf("Error: multi segment lengths should be int numbers.\n");
+            return TCL_ERROR;
+        }
+        if( (segment->single_write_length<0) || (segment->single_write_length>0xFF) ||
+            (segment->multi_write_length<0) || (segment->multi_write_length>0xFFFF) ||
+            (segment->read_length<0) || (segment->read_length>0xFFFF) )
+        {
+            printf("Error: multi segment lengths should be 0~255, 0~65535 and 0~65535.\n");
+            return TCL_ERROR;
+        }
+        segment->length = segment->single_write_length+segment->multi_write_length;
+    }
+    else if(type=="lines")
+    {
+        if( (objc!=2) || (Tcl_GetIntFromObj(interp, objv[1], &segment->lines)!=TCL_OK) ||
+            ((segment->lines!=1) && (segment->lines!=2) && (segment->lines!=4)) )
+        {
+            printf("Error: segment lines <1|2|4>.\n");
+            return TCL_ERROR;
+        }
+        segment->type = SEGMENT_LINES;
+    }
+    else if( (type=="cs_release") && (objc==1) )
+    {
+        segment->type = SEGMENT_CS_RELEASE;
+    }
+    else
+    {
+        printf("Error: segment type should be <write|read|read_write|multi|lines|cs_release>.\n");
         return TCL_ERROR;
     }
-    else if(ftStatus!=FT_OK)
+
+    if(segment->length<0)
     {
-        printf("Error: FT4222_SPI_Reset returns(%d), unknown error.\n", ftStatus);
+        printf("Error: <length> should not be negative.\n");
         return TCL_ERROR;
     }
 
-    debug("Info: spi_reset, done.\n");
     return TCL_OK;
 }
 
-int do_spi_set_drive_strength(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int do_spi_master_transaction(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    int drive_strength;
-    SPI_DrivingStrength ds;
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    ReadTarget target;
+    int i;
+    int segment_count;
+    Tcl_Obj **segment_objv;
+    std::vector <SpiSegment> segments;
+    std::vector < std::vector <unsigned char> > gathers;
+    std::string objv2_string;
+    bool cs_keep;
+    bool single_line;
+    int read_length;
+    int offset;
+    int sizeTransferred;
+    uint32_t sizeRead;
+    unsigned char* tx_buffer;
+    unsigned char* rx_buffer;
+    Tcl_Obj *byteArrayObj;
+    FT4222_SPIMode ioLine;
+    const char* function;
 
-    if (objc != 2)
+    if (ParseReadTarget(interp, &objc, objv, &target) != TCL_OK)
     {
-        printf("Error: spi_set_drive_strength <0~3>.\n");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &drive_strength) != TCL_OK)
+    if ( (objc!=2) && (objc!=3) )
     {
-        printf("Error: <drive_strength> should be a int number.\n");;
+        printf("Error: spi_master_transaction <segment_list> [cs_keep] [-into varName [-offset N]].\n");
         return TCL_ERROR;
     }
 
-    if( (drive_strength<0) || (drive_strength>3) )
+    if (Tcl_ListObjGetElements(interp, objv[1], &segment_count, &segment_objv) != TCL_OK)
     {
-        printf("Error: drive_strength should be 0~3.\n");
+        printf("Error: <segment_list> should be a list.\n");
         return TCL_ERROR;
     }
 
-    ds =
-        (drive_strength==0) ? DS_4MA  : \
-        (drive_strength==1) ? DS_8MA  : \
-        (drive_strength==2) ? DS_12MA : \
-        (drive_strength==3) ? DS_16MA : \
-        DS_16MA;
+    if (objc==3)
+    {
+        objv2_string = Tcl_GetString(objv[2]);
+        cs_keep = (objv2_string=="cs_keep") ? true : false;
+    }
+    else
+        cs_keep = false;
+    debug("Debug: cs_keep = %s\n", cs_keep?"true":"false");
 
-    ftStatus = FT4222_SPI_SetDrivingStrength(ftHandle, ds, ds, ds);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    segments.resize(segment_count);
+    gathers.resize(segment_count);
+    read_length = 0;
+    for(i=0; i<segment_count; i++)
+    {
+        if (ParseSpiSegment(interp, segment_objv[i], &segments[i], gathers[i]) != TCL_OK)
+        {
+            printf("Error: segment %d is invalid.\n", i);
+            return TCL_ERROR;
+        }
+        read_length += segments[i].read_length;
+    }
+
+    // a single line segment ends the CS window if the next one can not share it
+    for(i=0; i<segment_count; i++)
+    {
+        if(i==segment_count-1)
+            segments[i].isEndTransaction = !cs_keep;
+        else
+            segments[i].isEndTransaction =
+                (segments[i+1].type==SEGMENT_MULTI) ||
+                (segments[i+1].type==SEGMENT_LINES) ||
+                (segments[i+1].type==SEGMENT_CS_RELEASE);
+    }
+
+    if (FlushPendingWrite(adapter) != TCL_OK)
     {
-        printf("Error: FT4222_SPI_SetDrivingStrength returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_IS_NOT_SPI_MODE)
+
+    rx_buffer = NewReadResult(interp, &target, &byteArrayObj, read_length);
+    if (rx_buffer == NULL)
     {
-        printf("Error: FT4222_SPI_SetDrivingStrength returns(%d), FT4222_IS_NOT_SPI_MODE.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus!=FT_OK)
+    offset = 0;
+
+    for(i=0; i<segment_count; i++)
+    {
+        SpiSegment &segment = segments[i];
+
+        sizeTransferred = segment.length;
+        single_line = true;
+
+        switch(segment.type)
+        {
+            case SEGMENT_WRITE:
+                function = "FT4222_SPIMaster_SingleWrite";
+                tx_buffer = GetWriteData(adapter, segment.array, segment.array_length, segment.length);
+                FlashScriptWrite(adapter, tx_buffer, segment.length);
+                ftStatus = SPIMaster_SingleWrite(adapter, tx_buffer, segment.length, &sizeTransferred, segment.isEndTransaction);
+                break;
+
+            case SEGMENT_READ:
+                function = "FT4222_SPIMaster_SingleRead";
+                ftStatus = SPIMaster_SingleRead(adapter, rx_buffer+offset, segment.length, &sizeTransferred, segment.isEndTransaction);
+                break;
+
+            case SEGMENT_READ_WRITE:
+                function = "FT4222_SPIMaster_SingleReadWrite";
+                tx_buffer = GetWriteData(adapter, segment.array, segment.array_length, segment.length);
+                FlashScriptWrite(adapter, tx_buffer, segment.length);
+                ftStatus = SPIMaster_SingleReadWrite(adapter, rx_buffer+offset, tx_buffer, segment.length, &sizeTransferred, segment.isEndTransaction);
+                break;
+
+            case SEGMENT_MULTI:
+                function = "FT4222_SPIMaster_MultiReadWrite";
+                single_line = false;
+                tx_buffer = GetWriteData(adapter, segment.array, segment.array_length, segment.length);
+                FlashScriptWrite(adapter, tx_buffer, segment.length);
+                sizeRead = 0;
+                ftStatus = FT4222_SPIMaster_MultiReadWrite
+                (
+                    adapter->handle,
+                    rx_buffer+offset,
+                    tx_buffer,
+                    (uint8)segment.single_write_length,
+                    (uint16)segment.multi_write_length,
+                    (uint16)segment.read_length,
+                    &sizeRead
+                );
+                sizeTransferred = (int)sizeRead;
+                break;
+
+            case SEGMENT_LINES:
+                function = "FT4222_SPIMaster_SetLines";
+                single_line = false;
+                ioLine = (segment.lines==1) ? SPI_IO_SINGLE :(segment.lines==2) ? SPI_IO_DUAL : SPI_IO_QUAD;
+                adapter->config.chunk_size = 0;
+                ftStatus = FT4222_SPIMaster_SetLines(adapter->handle, ioLine);
+                sizeTransferred = 0;
+                break;
+
+            case SEGMENT_CS_RELEASE:
+            default:
+                continue;
+        }
+
+        if(ftStatus!=FT_OK)
+        {
+            FreeReadResult(byteArrayObj);
+            printf("Error: segment %d, %s returns(%d), %s.\n", i, function, ftStatus, FT4222StatusString(ftStatus));
+            return TCL_ERROR;
+        }
+
+        // the flash commands take the lines from the config, as spi_master_set_lines keeps it
+        if(segment.type==SEGMENT_LINES)
+        {
+            adapter->config.lines = segment.lines;
+            adapter->config.max_lines = std::max(adapter->config.max_lines, segment.lines);
+        }
+
+        if( (single_line && (sizeTransferred!=segment.length)) ||
+            (!single_line && (sizeTransferred!=segment.read_length)) )
+        {
+            FreeReadResult(byteArrayObj);
+            printf("Error: segment %d, %s is required to transfer %d byte(s), but actually transfer %d byte(s).\n", i, function, single_line?segment.length:segment.read_length, sizeTransferred);
+            return TCL_ERROR;
+        }
+
+        offset += segment.read_length;
+    }
+
+    debug("Debug: rx_buffer:\n");
+    for(i=0; i<read_length; i++)
+    {
+        debug(" %02x", rx_buffer[i]);
+    }
+    debug("\n");
+
+    if (SetReadResult(interp, &target, byteArrayObj, read_length) != TCL_OK)
     {
-        printf("Error: FT4222_SPI_SetDrivingStrength returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
 
-    debug("Info: spi_set_drive_strength %d, done.\n", drive_strength);
+    debug("Info: spi_master_transaction, done.\n");
     return TCL_OK;
 }
 
-int do_spi_master_init(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int do_i2c_master_init(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    int lines;
-    int cpol;
-    int cpha;
-    FT4222_SPIMode ioLine;
-    FT4222_SPICPOL ftCPOL;
-    FT4222_SPICPHA ftCPHA;
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    int freq;
 
-    if (objc != 4)
+    if (objc != 2)
     {
-        printf("Error: spi_master_init <lines> <cpol> <cpha>.\n");
+        printf("Error: i2c_master_init <kbps>.\n");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &lines) != TCL_OK)
+    if (Tcl_GetIntFromObj(interp, objv[1], &freq) != TCL_OK)
+    {
+        printf("Error: <kbps> should be a int number.\n");;
+        return TCL_ERROR;
+    }
+
+    adapter->config.chunk_size = 0;
+    ftStatus = FT4222_I2CMaster_Init(adapter->handle, (uint32)freq);
+    if(ftStatus==FT4222_DEVICE_NOT_SUPPORTED)
+    {
+        printf("Error: FT4222_I2CMaster_Init returns(%d), FT4222_DEVICE_NOT_SUPPORTED.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_I2C_NOT_SUPPORTED_IN_THIS_MODE)
+    {
+        printf("Error: FT4222_I2CMaster_Init returns(%d), FT4222_I2C_NOT_SUPPORTED_IN_THIS_MODE.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus!=FT_OK)
+    {
+        printf("Error: FT4222_I2CMaster_Init returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    debug("Info: i2c_master_init %d, done.\n", freq);
+    return TCL_OK;
+}
+
+int do_i2c_master_read(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    ReadTarget target;
+    unsigned char* rx_buffer;
+    Tcl_Obj *byteArrayObj;
+    int i;
+    int slave;
+    int length;
+    int sizeTransferred;
+
+    if (ParseReadTarget(interp, &objc, objv, &target) != TCL_OK)
     {
-        printf("Error: <lines> should be a int number.\n");;
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[2], &cpol) != TCL_OK)
+    if (objc!=3)
     {
-        printf("Error: <cpol> should be a int number.\n");;
+        printf("Error: i2c_master_read <slave> <length> [-into varName [-offset N]].\n");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[3], &cpha) != TCL_OK)
+    if (Tcl_GetIntFromObj(interp, objv[1], &slave) != TCL_OK)
     {
-        printf("Error: <cpha> should be a int number.\n");;
+        printf("Error: <slave> should be a int number.\n");
         return TCL_ERROR;
     }
+    debug("Debug: slave = %d\n", slave);
 
-    if( (lines!=1) && (lines!=2) && (lines!=4) )
+    if (Tcl_GetIntFromObj(interp, objv[2], &length) != TCL_OK)
     {
-        printf("Error: lines should be 1/2/4.\n");
+        printf("Error: <length> should be a int number.\n");
         return TCL_ERROR;
     }
+    debug("Debug: length = %d\n", slave);
 
-    if( (cpol!=0) && (cpol!=1) )
+    if (length < 0)
     {
-        printf("Error: cpol should be 0/1.\n");
+        printf("Error: <length> should not be negative.\n");
         return TCL_ERROR;
     }
 
-    if( (cpha!=0) && (cpha!=1) )
+    rx_buffer = NewReadResult(interp, &target, &byteArrayObj, length);
+    if (rx_buffer == NULL)
     {
-        printf("Error: cpha should be 0/1.\n");
         return TCL_ERROR;
     }
 
-    ioLine = (lines==1) ? SPI_IO_SINGLE :(lines==2) ? SPI_IO_DUAL : (lines==4) ? SPI_IO_QUAD : SPI_IO_SINGLE;
-    ftCPOL = (cpol==0) ? CLK_IDLE_LOW : CLK_IDLE_HIGH;
-    ftCPHA = (cpha==0) ? CLK_LEADING : CLK_TRAILING;
+    ftStatus = I2CMaster_Read(adapter, (uint16)slave, rx_buffer, length, &sizeTransferred);
+    if( (ftStatus!=FT_OK) || (sizeTransferred!=length) )
+    {
+        FreeReadResult(byteArrayObj);
+    }
 
-    ftStatus = FT4222_SetClock(ftHandle, Config.sys_clk);
-    if(ftStatus==FT4222_DEVICE_NOT_SUPPORTED)
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
     {
-        printf("Error: FT4222_SetClock fail(%d), FT4222_DEVICE_NOT_SUPPORT.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus!=FT_OK)
+    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
     {
-        printf("Error: FT4222_SetClock fail(%d), unknown error.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
         return TCL_ERROR;
     }
-    debug("Info: frequency set to %.3fkHz.\n", (float)Config.real_freq/1000);
-
-    ftStatus = FT4222_SPIMaster_Init(ftHandle, ioLine, Config.clk_div, ftCPOL, ftCPHA, 0x1);
-    if(ftStatus==FT4222_DEVICE_NOT_SUPPORTED)
+    else if(ftStatus==FT4222_INVALID_POINTER)
     {
-        printf("Error: FT4222_SPIMaster_Init returns(%d), FT4222_DEVICE_NOT_SUPPORTED.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
         return TCL_ERROR;
     }
     else if(ftStatus==FT4222_INVALID_PARAMETER)
     {
-        printf("Error: FT4222_SPIMaster_Init returns(%d), INVALID_PARAMETER.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_INVALID_PARAMETER.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus!=FT_OK)
+    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
     {
-        printf("Error: FT4222_SPIMaster_Init returns(%d), unknown error.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
         return TCL_ERROR;
     }
-    debug("Info: spi_master_init %d %d %d, done.\n", lines, cpol, cpha);
-
-    return TCL_OK;
-}
-
-int do_spi_master_set_lines(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
-{
-    int lines;
-    FT4222_SPIMode ioLine;
-
-    if (objc != 2)
+    else if(ftStatus!=FT_OK)
     {
-        printf("Error: spi_master_set_lines <lines>.\n");
+        printf("Error: FT4222_I2CMaster_Read returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &lines) != TCL_OK)
+    if(sizeTransferred != length)
     {
-        printf("Error: <lines> should be a int number.\n");;
+        printf("Error: FT4222_I2CMaster_Read is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
         return TCL_ERROR;
     }
 
-    if( (lines!=1) && (lines!=2) && (lines!=4) )
+    debug("Debug: rx_buffer:\n");
+    for(i=0; i<length; i++)
     {
-        printf("Error: lines should be 1/2/4.\n");
-        return TCL_ERROR;
+        debug(" %02x", rx_buffer[i]);
     }
+    debug("\n");
 
-    ioLine = (lines==1) ? SPI_IO_SINGLE :(lines==2) ? SPI_IO_DUAL : (lines==4) ? SPI_IO_QUAD : SPI_IO_SINGLE;
-
-    ftStatus = FT4222_SPIMaster_SetLines(ftHandle, ioLine);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
-    {
-        printf("Error: FT4222_SPIMaster_SetLines returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
-        return TCL_ERROR;
-    }
-    else if(ftStatus==FT4222_IS_NOT_SPI_MODE)
-    {
-        printf("Error: FT4222_SPIMaster_SetLines returns(%d), FT4222_IS_NOT_SPI_MODE.\n", ftStatus);
-        return TCL_ERROR;
-    }
-    else if(ftStatus==FT4222_NOT_SUPPORTED)
-    {
-        printf("Error: FT4222_SPIMaster_SetLines returns(%d), FT4222_NOT_SUPPORTED.\n", ftStatus);
-        return TCL_ERROR;
-    }
-    else if(ftStatus!=FT_OK)
+    if (SetReadResult(interp, &target, byteArrayObj, length) != TCL_OK)
     {
-        printf("Error: FT4222_SPIMaster_SetLines returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
-    debug("Info: spi_master_set_lines %d, done.\n", lines);
 
+    debug("Info: i2c_master_read, done.\n");
     return TCL_OK;
 }
 
-int do_spi_master_set_mode(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int do_i2c_master_write(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    int cpol;
-    int cpha;
-    FT4222_SPICPOL ftCPOL;
-    FT4222_SPICPHA ftCPHA;
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    int i;
+    int slave;
+    int length;
+    int sizeTransferred;
+    unsigned char* objv1_array;
+    unsigned char* tx_buffer;
+    int array_length;
 
-    if (objc != 3)
+    if (objc!=4)
     {
-        printf("Error: spi_master_set_mode <cpol> <cpha>.\n");
+        printf("Error: i2c_master_write <slave> <write_buffer> <length>.\n");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &cpol) != TCL_OK)
+    if (Tcl_GetIntFromObj(interp, objv[1], &slave) != TCL_OK)
     {
-        printf("Error: <cpol> should be a int number.\n");;
+        printf("Error: <slave> should be a int number.\n");
         return TCL_ERROR;
     }
+    debug("Debug: slave = %d\n", slave);
 
-    if (Tcl_GetIntFromObj(interp, objv[2], &cpha) != TCL_OK)
+    objv1_array = GetWriteBuffer(objv[2], &array_length, adapter->config.gather_buffer);
+
+    if (Tcl_GetIntFromObj(interp, objv[3], &length) != TCL_OK)
     {
-        printf("Error: <cpha> should be a int number.\n");;
+        printf("Error: <length> should be a int number.\n");
         return TCL_ERROR;
     }
+    debug("Debug: length = %d\n", slave);
 
-    if( (cpol!=0) && (cpol!=1) )
+    if (length < 0)
     {
-        printf("Error: cpol should be 0/1.\n");
+        printf("Error: <length> should not be negative.\n");
         return TCL_ERROR;
     }
 
-    if( (cpha!=0) && (cpha!=1) )
+    tx_buffer = GetWriteData(adapter, objv1_array, array_length, length);
+
+    debug("Debug: tx_buffer:\n");
+    for(i=0; i<length; i++)
     {
-        printf("Error: cpha should be 0/1.\n");
-        return TCL_ERROR;
+        debug(" %02x", tx_buffer[i]);
     }
+    debug("\n");
 
-    ftCPOL = (cpol==0) ? CLK_IDLE_LOW : CLK_IDLE_HIGH;
-    ftCPHA = (cpha==0) ? CLK_LEADING : CLK_TRAILING;
-
-    ftStatus = FT4222_SPIMaster_SetMode(ftHandle, ftCPOL, ftCPHA);
+    ftStatus = I2CMaster_Write(adapter, (uint16)slave, tx_buffer, length, &sizeTransferred);
     if(ftStatus==FT4222_DEVICE_NOT_OPENED)
     {
-        printf("Error: FT4222_SPIMaster_SetMode returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_IS_NOT_SPI_MODE)
+    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
     {
-        printf("Error: FT4222_SPIMaster_SetMode returns(%d), FT4222_IS_NOT_SPI_MODE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_NOT_SUPPORTED)
+    else if(ftStatus==FT4222_INVALID_POINTER)
     {
-        printf("Error: FT4222_SPIMaster_SetMode returns(%d), FT4222_NOT_SUPPORTED.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_INVALID_PARAMETER)
+    {
+        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_INVALID_PARAMETER.\n", ftStatus);
+        return TCL_ERROR;
+    }
+    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+    {
+        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
         return TCL_ERROR;
     }
     else if(ftStatus!=FT_OK)
     {
-        printf("Error: FT4222_SPIMaster_SetMode returns(%d), unknown error.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Write returns(%d), unknown error.\n", ftStatus);
+        return TCL_ERROR;
+    }
+
+    if((int)sizeTransferred != length)
+    {
+        printf("Error: FT4222_I2CMaster_Write is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
         return TCL_ERROR;
     }
-    debug("Info: spi_master_set_mode %d %d, done.\n", cpol, cpha);
 
+    debug("Info: i2c_master_write, done.\n");
     return TCL_OK;
 }
 
-int do_spi_master_single_write(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int do_i2c_master_read_extension(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    ReadTarget target;
+    unsigned char* rx_buffer;
+    Tcl_Obj *byteArrayObj;
     int i;
+    int slave;
     int length;
-    int array_length;
-    unsigned char* objv1_array;
-    std::string objv3_string;
-    bool cs_keep;
-    bool isEndTransaction;
-    uint16_t sizeTransferred;
+    int sizeTransferred;
+    std::string flag_string;
+    uint8 flag;
 
-    if ( (objc!=3) && (objc!=4))
+    if (ParseReadTarget(interp, &objc, objv, &target) != TCL_OK)
     {
-        printf("Error: spi_master_single_write <write_buffer> <length> [cs_keep].\n");
         return TCL_ERROR;
     }
 
-    objv1_array = Tcl_GetByteArrayFromObj(objv[1], &array_length);
+    if (objc!=4)
+    {
+        printf("Error: i2c_master_read_extension <slave> <length> <flag> [-into varName [-offset N]].\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &slave) != TCL_OK)
+    {
+        printf("Error: <slave> should be a int number.\n");
+        return TCL_ERROR;
+    }
+    debug("Debug: slave = %d\n", slave);
 
     if (Tcl_GetIntFromObj(interp, objv[2], &length) != TCL_OK)
     {
         printf("Error: <length> should be a int number.\n");
         return TCL_ERROR;
     }
-    debug("Debug: length = %d\n", length);
+    debug("Debug: length = %d\n", slave);
 
-    for(i=0; i<8192; i++)
+    if (length < 0)
     {
-        Config.tx_buffer[i] = 0x0;
+        printf("Error: <length> should not be negative.\n");
+        return TCL_ERROR;
     }
 
-    for(i=0; i<length; i++)
+    flag_string = Tcl_GetString(objv[3]);
+    if(flag_string=="START")
+        flag = 0x2;
+    else if(flag_string=="Repeated_START")
+        flag = 0x3;
+    else if(flag_string=="STOP")
+        flag = 0x4;
+    else if(flag_string=="START_AND_STOP")
+        flag = 0x6;
+    else
     {
-        Config.tx_buffer[i] = static_cast<unsigned char>(objv1_array[i]);
+        printf("Error: flag should be <START|Repeated_START|STOP|START_AND_STOP>");
+        return TCL_ERROR;
     }
 
-    debug("Debug: tx_buffer:\n");
-    for(i=0; i<length; i++)
+    rx_buffer = NewReadResult(interp, &target, &byteArrayObj, length);
+    if (rx_buffer == NULL)
     {
-        debug(" %02x", Config.tx_buffer[i]);
+        return TCL_ERROR;
     }
-    debug("\n");
 
-    if (objc==4)
+    ftStatus = I2CMaster_ReadEx(adapter, (uint16)slave, flag, rx_buffer, length, &sizeTransferred);
+    if( (ftStatus!=FT_OK) || (sizeTransferred!=length) )
     {
-        objv3_string = Tcl_GetString(objv[3]);
-        cs_keep = (objv3_string=="cs_keep") ? true : false; 
+        FreeReadResult(byteArrayObj);
     }
-    else
-        cs_keep = false;
-    debug("Debug: cs_keep = %s\n", cs_keep?"true":"false");
-    isEndTransaction = cs_keep?false:true;
 
-    ftStatus = FT4222_SPIMaster_SingleWrite(ftHandle, Config.tx_buffer, (uint16_t)length, &sizeTransferred, isEndTransaction);
     if(ftStatus==FT4222_DEVICE_NOT_OPENED)
     {
-        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_INVALID_POINTER)
+    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
     {
-        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_IS_NOT_SPI_SINGLE_MODE)
+    else if(ftStatus==FT4222_INVALID_POINTER)
     {
-        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_IS_NOT_SPI_SINGLE_MODE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+    else if(ftStatus==FT4222_INVALID_PARAMETER)
     {
-        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_INVALID_PARAMETER.\n", ftStatus);
         return TCL_ERROR;
     }
     else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
     {
-        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
         return TCL_ERROR;
     }
     else if(ftStatus!=FT_OK)
     {
-        printf("Error: FT4222_SPIMaster_SingleWrite returns(%d), unknown error.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
 
-    if((int)sizeTransferred != length)
+    if(sizeTransferred != length)
     {
-        printf("Error: FT4222_SPIMaster_SingleWrite is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
+        printf("Error: FT4222_I2CMaster_ReadEx is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
         return TCL_ERROR;
     }
 
-    debug("Info: spi_master_single_write, done.\n");
+    debug("Debug: rx_buffer:\n");
+    for(i=0; i<length; i++)
+    {
+        debug(" %02x", rx_buffer[i]);
+    }
+    debug("\n");
+
+    if (SetReadResult(interp, &target, byteArrayObj, length) != TCL_OK)
+    {
+        return TCL_ERROR;
+    }
+
+    debug("Info: i2c_master_read_extension, done.\n");
     return TCL_OK;
 }
 
-int do_spi_master_single_read(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int do_i2c_master_write_extension(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
     int i;
+    int slave;
     int length;
-    std::string objv3_string;
-    bool cs_keep;
-    bool isEndTransaction;
-    uint16_t sizeTransferred;
+    int sizeTransferred;
+    unsigned char* objv1_array;
+    unsigned char* tx_buffer;
+    int array_length;
+    std::string flag_string;
+    uint8 flag;
 
-    if ( (objc!=2) && (objc!=3))
+    if (objc!=5)
+    {
+        printf("Error: i2c_master_write_extension <slave> <write_buffer> <length> <flag>.\n");
+        return TCL_ERROR;
+    }
+
+    if (Tcl_GetIntFromObj(interp, objv[1], &slave) != TCL_OK)
     {
-        printf("Error: spi_master_single_read <length> [cs_keep].\n");
+        printf("Error: <slave> should be a int number.\n");
         return TCL_ERROR;
     }
+    debug("Debug: slave = %d\n", slave);
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &length) != TCL_OK)
+    objv1_array = GetWriteBuffer(objv[2], &array_length, adapter->config.gather_buffer);
+
+    if (Tcl_GetIntFromObj(interp, objv[3], &length) != TCL_OK)
     {
         printf("Error: <length> should be a int number.\n");
         return TCL_ERROR;
     }
-    debug("Debug: length = %d\n", length);
+    debug("Debug: length = %d\n", slave);
 
-    if (objc==3)
+    if (length < 0)
     {
-        objv3_string = Tcl_GetString(objv[2]);
-        cs_keep = (objv3_string=="cs_keep") ? true : false; 
+        printf("Error: <length> should not be negative.\n");
+        return TCL_ERROR;
     }
+
+    flag_string = Tcl_GetString(objv[4]);
+    if(flag_string=="START")
+        flag = 0x2;
+    else if(flag_string=="Repeated_START")
+        flag = 0x3;
+    else if(flag_string=="STOP")
+        flag = 0x4;
+    else if(flag_string=="START_AND_STOP")
+        flag = 0x6;
     else
-        cs_keep = false;
-    debug("Debug: cs_keep = %s\n", cs_keep?"true":"false");
-    isEndTransaction = cs_keep?false:true;
+    {
+        printf("Error: flag should be <START|Repeated_START|STOP|START_AND_STOP>");
+        return TCL_ERROR;
+    }
 
-    for(i=0; i<8192; i++)
+    tx_buffer = GetWriteData(adapter, objv1_array, array_length, length);
+
+    debug("Debug: tx_buffer:\n");
+    for(i=0; i<length; i++)
     {
-        Config.rx_buffer[i] = 0x0;
+        debug(" %02x", tx_buffer[i]);
     }
+    debug("\n");
 
-    ftStatus = FT4222_SPIMaster_SingleRead(ftHandle, Config.rx_buffer, (uint16_t)length, &sizeTransferred, isEndTransaction);
+    ftStatus = I2CMaster_WriteEx(adapter, (uint16)slave, flag, tx_buffer, length, &sizeTransferred);
     if(ftStatus==FT4222_DEVICE_NOT_OPENED)
     {
-        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_INVALID_POINTER)
+    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
     {
-        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_IS_NOT_SPI_SINGLE_MODE)
+    else if(ftStatus==FT4222_INVALID_POINTER)
     {
-        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_IS_NOT_SPI_SINGLE_MODE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+    else if(ftStatus==FT4222_INVALID_PARAMETER)
     {
-        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_INVALID_PARAMETER.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
     {
-        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
         return TCL_ERROR;
     }
     else if(ftStatus!=FT_OK)
     {
-        printf("Error: FT4222_SPIMaster_SingleRead returns(%d), unknown error.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
 
-    if(sizeTransferred != length)
+    if((int)sizeTransferred != length)
     {
-        printf("Error: FT4222_SPIMaster_SingleRead is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
+        printf("Error: FT4222_I2CMaster_WriteEx is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
         return TCL_ERROR;
     }
 
-    debug("Debug: rx_buffer:\n");
-    for(i=0; i<length; i++)
-    {
-        debug(" %02x", Config.rx_buffer[i]);
-    }
-    debug("\n");
-
-    Tcl_Obj *byteArrayObj = Tcl_NewByteArrayObj(Config.rx_buffer, length);
-    Tcl_SetObjResult(interp, byteArrayObj);
-
-    debug("Info: spi_master_single_read, done.\n");
+    debug("Info: i2c_master_write_extension, done.\n");
     return TCL_OK;
 }
 
-int do_spi_master_single_read_write(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int do_i2c_master_get_status(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    int i;
-    int length;
-    int array_length;
-    unsigned char* objv1_array;
-    std::string objv3_string;
-    bool cs_keep;
-    bool isEndTransaction;
-    uint16_t sizeTransferred;
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+    uint8 controller_status;
 
-    if ( (objc!=3) && (objc!=4))
+    if (objc != 1)
     {
-        printf("Error: spi_master_single_write <write_buffer> <length> [cs_keep].\n");
+        printf("Error: i2c_master_get_status accepts no parameter.\n");
         return TCL_ERROR;
     }
 
-    objv1_array = Tcl_GetByteArrayFromObj(objv[1], &array_length);
-
-    if (Tcl_GetIntFromObj(interp, objv[2], &length) != TCL_OK)
+    ftStatus = FT4222_I2CMaster_GetStatus(adapter->handle, &controller_status);
+    if(ftStatus!=FT4222_OK)
     {
-        printf("Error: <length> should be a int number.\n");
+        printf("Error: FT4222_I2CMaster_GetStatus returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
-    debug("Debug: length = %d\n", length);
 
-    for(i=0; i<8192; i++)
-    {
-        Config.tx_buffer[i] = 0x0;
-    }
+    Tcl_Obj *intObj = Tcl_NewIntObj((int)controller_status);
+    Tcl_SetObjResult(interp, intObj);
 
-    for(i=0; i<length; i++)
-    {
-        Config.tx_buffer[i] = static_cast<unsigned char>(objv1_array[i]);
-    }
+    debug("Info: i2c_master_get_status, done.\n");
+    return TCL_OK;
+}
 
-    debug("Debug: tx_buffer:\n");
-    for(i=0; i<length; i++)
-    {
-        debug(" %02x", Config.tx_buffer[i]);
-    }
-    debug("\n");
+int do_i2c_master_reset(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
 
-    if (objc==4)
+    if (objc != 1)
     {
-        objv3_string = Tcl_GetString(objv[3]);
-        cs_keep = (objv3_string=="cs_keep") ? true : false; 
+        printf("Error: i2c_master_reset accepts no parameter.\n");
+        return TCL_ERROR;
     }
-    else
-        cs_keep = false;
-    debug("Debug: cs_keep = %s\n", cs_keep?"true":"false");
-    isEndTransaction = cs_keep?false:true;
 
-    ftStatus = FT4222_SPIMaster_SingleReadWrite(ftHandle, Config.rx_buffer, Config.tx_buffer, (uint16_t)length, &sizeTransferred, isEndTransaction);
+    ftStatus = FT4222_I2CMaster_Reset(adapter->handle);
     if(ftStatus==FT4222_DEVICE_NOT_OPENED)
     {
-        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Reset returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_INVALID_POINTER)
+    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
     {
-        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Reset returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_IS_NOT_SPI_SINGLE_MODE)
+    else if(ftStatus!=FT_OK)
     {
-        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_IS_NOT_SPI_SINGLE_MODE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_Reset returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+
+    debug("Info: i2c_master_reset, done.\n");
+    return TCL_OK;
+}
+
+int do_i2c_master_reset_bus(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Adapter *adapter = GetAdapter(clientData);
+    FT_STATUS ftStatus;
+
+    if (objc != 1)
     {
-        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
+        printf("Error: i2c_master_reset_bus accepts no parameter.\n");
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+
+    ftStatus = FT4222_I2CMaster_ResetBus(adapter->handle);
+    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
     {
-        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_ResetBus returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
         return TCL_ERROR;
     }
     else if(ftStatus!=FT_OK)
     {
-        printf("Error: FT4222_SPIMaster_SingleReadWrite returns(%d), unknown error.\n", ftStatus);
+        printf("Error: FT4222_I2CMaster_ResetBus returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
 
-    if((int)sizeTransferred != length)
-    {
-        printf("Error: FT4222_SPIMaster_SingleReadWrite is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
-        return TCL_ERROR;
+    debug("Info: i2c_master_reset_bus, done.\n");
+    return TCL_OK;
+}
+
+// the flash parameters as a dict
+Tcl_Obj* FlashConfigObj(const FlashConfig *flash)
+{
+    const FlashReadMode *modes[4] = { &flash->read_112, &flash->read_122, &flash->read_114, &flash->read_144 };
+    const char *names[4] = { "read_112", "read_122", "read_114", "read_144" };
+    Tcl_Obj *resultObj = Tcl_NewListObj(0, NULL);
+    Tcl_Obj *listObj;
+    char hex[8];
+    int i;
+
+    snprintf(hex, sizeof(hex), "%06x", flash->jedec_id);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("jedec_id", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(hex, -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("sfdp", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewBooleanObj(flash->sfdp));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("size", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(flash->size));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("address_bytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(flash->address_bytes));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("page_size", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(flash->page_size));
+
+    // {size opcode typical_ms max_ms} of each erase type
+    listObj = Tcl_NewListObj(0, NULL);
+    for(i=0; i<4; i++)
+    {
+        if(flash->erase_types[i].size!=0)
+        {
+            snprintf(hex, sizeof(hex), "0x%02x", flash->erase_types[i].opcode);
+            Tcl_Obj *typeObj = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(NULL, typeObj, Tcl_NewIntObj(flash->erase_types[i].size));
+            Tcl_ListObjAppendElement(NULL, typeObj, Tcl_NewStringObj(hex, -1));
+            Tcl_ListObjAppendElement(NULL, typeObj, Tcl_NewIntObj(flash->erase_types[i].typical_ms));
+            Tcl_ListObjAppendElement(NULL, typeObj, Tcl_NewIntObj(flash->erase_types[i].max_ms));
+            Tcl_ListObjAppendElement(NULL, listObj, typeObj);
+        }
     }
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("erase", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, listObj);
 
-    debug("Debug: rx_buffer:\n");
-    for(i=0; i<length; i++)
+    // {opcode dummy_clocks mode_clocks} of each supported fast read
+    for(i=0; i<4; i++)
     {
-        debug(" %02x", Config.rx_buffer[i]);
+        if(modes[i]->opcode!=0)
+        {
+            snprintf(hex, sizeof(hex), "0x%02x", modes[i]->opcode);
+            listObj = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj(hex, -1));
+            Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewIntObj(modes[i]->dummy_clocks));
+            Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewIntObj(modes[i]->mode_clocks));
+            Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(names[i], -1));
+            Tcl_ListObjAppendElement(NULL, resultObj, listObj);
+        }
     }
-    debug("\n");
-
-    Tcl_Obj *byteArrayObj = Tcl_NewByteArrayObj(Config.rx_buffer, length);
-    Tcl_SetObjResult(interp, byteArrayObj);
 
-    debug("Info: spi_master_single_read_write, done.\n");
-    return TCL_OK;
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("page_program_us", -1));
+    listObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewIntObj(flash->program_typical_us));
+    Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewIntObj(flash->program_max_us));
+    Tcl_ListObjAppendElement(NULL, resultObj, listObj);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("chip_erase_ms", -1));
+    listObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewIntObj(flash->chip_erase_typical_ms));
+    Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewIntObj(flash->chip_erase_max_ms));
+    Tcl_ListObjAppendElement(NULL, resultObj, listObj);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("qe_requirement", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(flash->qe_requirement));
+
+    return resultObj;
 }
 
-int do_spi_master_multi_read_write(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+//
+// flash id
+// flash sfdp [-reread]
+// flash read <address> <length> [-mode <mode>] [-into varName [-offset N]]
+// flash dump <address> <length> <file> [-hash] [-sparse] [-manifest <file>] [-mode <mode>]
+// flash erase <address> <length>
+// flash program <address> <write_buffer> [-noerase]
+// flash program_file <address> <file> [<length>] [-noerase|-chip] [-mode <mode>]
+// flash verify <address> <write_buffer>
+//
+// flash interleave <address> {<cs> <image> ...} [-noerase] [-noverify] [-sequential]
+int FlashInterleaveCommand(Adapter *adapter, Tcl_Interp *interp, uint32 address, int objc, Tcl_Obj *const objv[])
 {
+    std::chrono::steady_clock::time_point start;
+    std::vector <FlashTarget> targets;
+    FlashInterleaveStats stats;
+    Tcl_Obj **elements;
+    Tcl_Obj *resultObj;
+    std::string option;
+    double seconds;
+    uint64 total;
+    bool erase = true;
+    bool verify = true;
+    bool sequential = false;
+    int count;
+    int cs;
     int i;
-    int single_write_length;
-    int multi_write_length;
-    int multi_read_length;
-    int array_length;
-    unsigned char* objv1_array;
-    uint32_t sizeRead;
-    int write_length;
 
-    if (objc!=5)
+    for(; objc > 4; objc--)
     {
-        printf("Error: spi_master_multi_read_write <write_buffer> <single_write_length> <multi_write_length> <multi_read_length>.\n");
-        return TCL_ERROR;
+        option = Tcl_GetString(objv[objc-1]);
+        if (option=="-noerase")
+            erase = false;
+        else if (option=="-noverify")
+            verify = false;
+        else if (option=="-sequential")
+            sequential = true;
+        else
+            break;
     }
 
-    objv1_array = Tcl_GetByteArrayFromObj(objv[1], &array_length);
-
-    if (Tcl_GetIntFromObj(interp, objv[2], &single_write_length) != TCL_OK)
+    if ( (objc != 4) || (Tcl_ListObjGetElements(NULL, objv[3], &count, &elements) != TCL_OK) || (count == 0) || (count % 2 != 0) )
     {
-        printf("Error: <single_write_length> should be a int number.\n");
+        printf("Error: flash interleave <address> {<cs> <image> ...} [-noerase] [-noverify] [-sequential].\n");
         return TCL_ERROR;
     }
-    debug("Debug: single_write_length = %d\n", single_write_length);
 
-    if (Tcl_GetIntFromObj(interp, objv[3], &multi_write_length) != TCL_OK)
+    targets.resize(count/2);
+    for(i=0; i<count/2; i++)
     {
-        printf("Error: <multi_write_length> should be a int number.\n");
-        return TCL_ERROR;
+        if ( (Tcl_GetIntFromObj(NULL, elements[2*i], &cs) != TCL_OK) || (cs < 0) || (cs > 3) )
+        {
+            printf("Error: <cs> should be 0~3, for SS0~SS3.\n");
+            return TCL_ERROR;
+        }
+        targets[i].cs = cs;
+        targets[i].data = GetWriteBytes(elements[2*i+1], &targets[i].length);
     }
-    debug("Debug: multi_write_length = %d\n", multi_write_length);
 
-    if (Tcl_GetIntFromObj(interp, objv[4], &multi_read_length) != TCL_OK)
+    start = std::chrono::steady_clock::now();
+    if (FlashInterleave(adapter, address, targets, erase, verify, sequential, &stats) != TCL_OK)
     {
-        printf("Error: <multi_read_length> should be a int number.\n");
         return TCL_ERROR;
     }
-    debug("Debug: multi_read_length = %d\n", multi_read_length);
-
-    write_length = single_write_length+multi_write_length;
+    seconds = std::chrono::duration <double> (std::chrono::steady_clock::now()-start).count();
 
-    for(i=0; i<8192; i++)
+    total = 0;
+    resultObj = Tcl_NewListObj(0, NULL);
+    for(i=0; i<(int)targets.size(); i++)
     {
-        Config.tx_buffer[i] = 0x0;
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(targets[i].cs));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj((targets[i].code==TCL_OK) ? "ok" : targets[i].error.c_str(), -1));
+        total += (targets[i].code==TCL_OK) ? targets[i].length : 0;
+        printf("Info: %s, SS%d %s, %d blank page(s) elided.\n", adapter->name.c_str(), targets[i].cs,
+            (targets[i].code==TCL_OK) ? "ok" : "failed", targets[i].elided);
     }
+    printf("Info: flash interleave %llu byte(s) to %d target(s) in %.3f second(s), %.3f MB/s in total%s.\n",
+        (unsigned long long)total, (int)targets.size(), seconds, (seconds>0) ? (double)total/seconds/1000000 : 0.0,
+        sequential ? ", sequential" : "");
+    printf("Info: %d chip select switch(es), %.3f ms each, %.3f second(s) in total.\n",
+        stats.switches, (stats.switches>0) ? stats.switch_seconds*1000/stats.switches : 0.0, stats.switch_seconds);
 
-    for(i=0; i<write_length; i++)
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+// flash dump <address> <length> <file> [-hash] [-sparse] [-manifest <file>] [-mode <mode>]
+int FlashDumpCommand(Adapter *adapter, Tcl_Interp *interp, uint32 address, int objc, Tcl_Obj *const objv[])
+{
+    std::vector < std::pair <uint32, uint32> > ranges;
+    FlashDumpStats stats;
+    Tcl_Obj *resultObj;
+    Tcl_Obj *manifestObj = NULL;
+    std::string option;
+    bool hash = false;
+    bool sparse = false;
+    int mode = FLASH_READ_AUTO;
+    int length;
+    char hex[20];
+    FILE *fp;
+    size_t i;
+    int code;
+
+    for(; objc > 5; objc--)
     {
-        Config.tx_buffer[i] = static_cast<unsigned char>(objv1_array[i]);
+        option = Tcl_GetString(objv[objc-1]);
+        if (option=="-hash")
+        {
+            hash = true;
+        }
+        else if (option=="-sparse")
+        {
+            sparse = true;
+        }
+        else if ( (objc > 6) && (strcmp(Tcl_GetString(objv[objc-2]), "-manifest") == 0) )
+        {
+            manifestObj = objv[objc-1];
+            objc--;
+        }
+        else if ( (objc > 6) && (strcmp(Tcl_GetString(objv[objc-2]), "-mode") == 0) )
+        {
+            if (Tcl_GetIndexFromObj(NULL, objv[objc-1], FlashReadModeNames, "mode", 0, &mode) != TCL_OK)
+            {
+                printf("Error: -mode should be auto/read/fast/dual/dual_io/quad/quad_io.\n");
+                return TCL_ERROR;
+            }
+            objc--;
+        }
+        else
+        {
+            break;
+        }
     }
 
-    debug("Debug: tx_buffer:\n");
-    for(i=0; i<write_length; i++)
+    if (objc != 5)
     {
-        debug(" %02x", Config.tx_buffer[i]);
+        printf("Error: flash dump <address> <length> <file> [-hash] [-sparse] [-manifest <file>] [-mode <mode>].\n");
+        return TCL_ERROR;
     }
-    debug("\n");
 
-    ftStatus = FT4222_SPIMaster_MultiReadWrite
-    (
-        ftHandle,
-        Config.rx_buffer,
-        Config.tx_buffer,
-        (uint16_t)single_write_length,
-        (uint16_t)multi_write_length,
-        (uint16_t)multi_read_length,
-        &sizeRead
-    );
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    if ( (Tcl_GetIntFromObj(interp, objv[3], &length) != TCL_OK) || (length < 0) )
     {
-        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        printf("Error: <length> should be a non-negative int number.\n");
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_INVALID_POINTER)
+
+    // the holes read as 0x00, only the manifest tells them from data
+    if ( sparse && (manifestObj == NULL) )
     {
-        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        printf("Error: -sparse needs -manifest <file>, the holes read as 0x00 not 0xFF.\n");
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+
+    fp = OpenFileObj(interp, objv[4], "wb");
+    if (fp == NULL)
     {
-        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
+        printf("Error: can't open %s for writing.\n", Tcl_GetString(objv[4]));
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+#ifdef _WIN32
+    // NTFS stores the seeked over ranges only if the file is marked sparse
+    if (sparse)
     {
-        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
-        return TCL_ERROR;
+        DWORD returned;
+        DeviceIoControl((HANDLE)_get_osfhandle(_fileno(fp)), FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
     }
-    else if(ftStatus!=FT_OK)
+#endif
+
+    code = FlashDump(adapter, address, length, mode, fp, hash, sparse, (manifestObj != NULL) ? &ranges : NULL, &stats);
+    if ( (fclose(fp) != 0) && (code == TCL_OK) )
+    {
+        code = FlashError(adapter, "dump write fails at close");
+    }
+    if (code != TCL_OK)
     {
-        printf("Error: FT4222_SPIMaster_MultiReadWrite returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
 
-    if((int)sizeRead != multi_read_length)
+    // the ranges not erased, one "<address> <length>" per line
+    if (manifestObj != NULL)
     {
-        printf("Error: FT4222_SPIMaster_MultiReadWrite is required to read %d byte(s), but actually read %d byte(s).\n", multi_read_length, sizeRead);
-        return TCL_ERROR;
+        fp = OpenFileObj(interp, manifestObj, "w");
+        if (fp == NULL)
+        {
+            printf("Error: can't open %s for writing.\n", Tcl_GetString(manifestObj));
+            return TCL_ERROR;
+        }
+        for (i = 0; i < ranges.size(); i++)
+        {
+            fprintf(fp, "0x%08x 0x%x\n", ranges[i].first, ranges[i].second);
+        }
+        if (fclose(fp) != 0)
+        {
+            printf("Error: can't write %s.\n", Tcl_GetString(manifestObj));
+            return TCL_ERROR;
+        }
     }
 
-    debug("Debug: rx_buffer:\n");
-    for(i=0; i<multi_read_length; i++)
+    resultObj = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("bytes", -1), Tcl_NewWideIntObj((Tcl_WideInt)stats.bytes));
+    Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("seconds", -1), Tcl_NewDoubleObj(stats.seconds));
+    Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("read_mbps", -1), Tcl_NewDoubleObj(MBps(stats.bytes, stats.read_seconds)));
+    if (hash)
     {
-        debug(" %02x", Config.rx_buffer[i]);
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)stats.hash);
+        Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("hash_mbps", -1), Tcl_NewDoubleObj(MBps(stats.bytes, stats.hash_seconds)));
+        Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("hash", -1), Tcl_NewStringObj(hex, -1));
+    }
+    Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("write_mbps", -1), Tcl_NewDoubleObj(MBps(stats.bytes, stats.write_seconds)));
+    if ( sparse || (manifestObj != NULL) )
+    {
+        Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("erased", -1), Tcl_NewWideIntObj((Tcl_WideInt)stats.erased));
     }
-    debug("\n");
 
-    Tcl_Obj *byteArrayObj = Tcl_NewByteArrayObj(Config.rx_buffer, multi_read_length);
-    Tcl_SetObjResult(interp, byteArrayObj);
+    // MB/s of each stage is over its busy time, the slowest one bounds the total
+    printf("Info: flash dump %llu byte(s) in %.3f second(s), %.3f MB/s.\n",
+        (unsigned long long)stats.bytes, stats.seconds, MBps(stats.bytes, stats.seconds));
+    printf("Info: read %.3f MB/s", MBps(stats.bytes, stats.read_seconds));
+    if (hash)
+    {
+        printf(", hash %.3f MB/s", MBps(stats.bytes, stats.hash_seconds));
+    }
+    printf(", write %.3f MB/s.\n", MBps(stats.bytes, stats.write_seconds));
 
-    debug("Info: spi_master_multi_read_write, done.\n");
+    Tcl_SetObjResult(interp, resultObj);
     return TCL_OK;
 }
 
-int do_i2c_master_init(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+// flash program_file <address> <file> [<length>] [-noerase|-chip] [-mode <mode>]
+int FlashProgramFileCommand(Adapter *adapter, Tcl_Interp *interp, uint32 address, int objc, Tcl_Obj *const objv[])
 {
-    int freq;
+    FlashStreamStats stats;
+    Tcl_Obj *resultObj;
+    std::string option;
+    int erase = FLASH_ERASE_RANGE;
+    int mode = FLASH_PROGRAM_AUTO;
+    int length = 0;
+    long file_length;
+    unsigned char magic[4];
+    unsigned char trailer[8];
+    uint32 crc = 0;
+    uint32 isize = 0;
+    bool gzip;
+    bool whole;
+    FILE *fp;
+    int code;
+
+    for(; objc > 4; objc--)
+    {
+        option = Tcl_GetString(objv[objc-1]);
+        if (option=="-noerase")
+        {
+            erase = FLASH_ERASE_NONE;
+        }
+        else if (option=="-chip")
+        {
+            erase = FLASH_ERASE_CHIP;
+        }
+        else if ( (objc > 5) && (strcmp(Tcl_GetString(objv[objc-2]), "-mode") == 0) )
+        {
+            if (Tcl_GetIndexFromObj(NULL, objv[objc-1], FlashProgramModeNames, "mode", 0, &mode) != TCL_OK)
+            {
+                printf("Error: -mode should be auto/single/quad.\n");
+                return TCL_ERROR;
+            }
+            objc--;
+        }
+        else
+        {
+            break;
+        }
+    }
 
-    if (objc != 2)
+    if ( (objc < 4) || (objc > 5) || ((objc == 5) && ((Tcl_GetIntFromObj(NULL, objv[4], &length) != TCL_OK) || (length < 0))) )
     {
-        printf("Error: i2c_master_init <kbps>.\n");
+        printf("Error: flash program_file <address> <file> [<length>] [-noerase|-chip] [-mode <mode>].\n");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &freq) != TCL_OK)
+    fp = OpenFileObj(interp, objv[3], "rb");
+    if (fp == NULL)
     {
-        printf("Error: <kbps> should be a int number.\n");;
+        printf("Error: can't open %s for reading.\n", Tcl_GetString(objv[3]));
         return TCL_ERROR;
     }
 
-    ftStatus = FT4222_I2CMaster_Init(ftHandle, (uint32)freq);
-    if(ftStatus==FT4222_DEVICE_NOT_SUPPORTED)
+    // A gzip image is inflated as it's programmed, and its length is the
+    // ISIZE at the end of the file, next to the CRC. Only a gzip of one
+    // member is taken, which the source checks by the CRC. A length of 0
+    // or beyond the image is the image length, as sf_prog does.
+    gzip = (fread(magic, 1, 4, fp) >= 2) && (magic[0] == 0x1f) && (magic[1] == 0x8b);
+    if ( (fseek(fp, gzip ? -8 : 0, SEEK_END) != 0) || ((file_length = ftell(fp)) < 0) ||
+         (gzip && (fread(trailer, 1, 8, fp) != 8)) || (fseek(fp, 0, SEEK_SET) != 0) )
     {
-        printf("Error: FT4222_I2CMaster_Init returns(%d), FT4222_DEVICE_NOT_SUPPORTED.\n", ftStatus);
+        fclose(fp);
+        printf("Error: can't read %s.\n", Tcl_GetString(objv[3]));
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_I2C_NOT_SUPPORTED_IN_THIS_MODE)
+    if (gzip)
     {
-        printf("Error: FT4222_I2CMaster_Init returns(%d), FT4222_I2C_NOT_SUPPORTED_IN_THIS_MODE.\n", ftStatus);
-        return TCL_ERROR;
+        crc = (uint32)trailer[0] | ((uint32)trailer[1]<<8) | ((uint32)trailer[2]<<16) | ((uint32)trailer[3]<<24);
+        isize = (uint32)trailer[4] | ((uint32)trailer[5]<<8) | ((uint32)trailer[6]<<16) | ((uint32)trailer[7]<<24);
+        file_length = (long)std::min(isize, (uint32)0x7fffffff);
     }
-    else if(ftStatus!=FT_OK)
+    whole = (length == 0) || (length >= file_length);
+    if (whole)
+    {
+        length = (int)std::min(file_length, (long)0x7fffffff);
+    }
+
+    code = FlashProgramStream(adapter, address, length, gzip ? FlashGzipSource(fp, crc, isize, length, whole) : FlashFileSource(fp), erase, mode, &stats);
+    fclose(fp);
+    if (code != TCL_OK)
     {
-        printf("Error: FT4222_I2CMaster_Init returns(%d), unknown error.\n", ftStatus);
         return TCL_ERROR;
     }
 
-    debug("Info: i2c_master_init %d, done.\n", freq);
+    printf("Info: flash program_file %d byte(s) in %.3f second(s), %.3f MB/s, %d blank page(s) elided.\n",
+        length, stats.seconds, MBps(length, stats.seconds), stats.elided);
+    printf("Info: stage %.3f MB/s, program %.3f MB/s.\n", MBps(length, stats.stage_seconds), MBps(length, stats.program_seconds));
+
+    resultObj = Tcl_NewDictObj();
+    Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("elided", -1), Tcl_NewIntObj(stats.elided));
+    Tcl_SetObjResult(interp, resultObj);
     return TCL_OK;
 }
 
-int do_i2c_master_read(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int FlashCommand(Adapter *adapter, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    int i;
-    int slave;
+    ReadTarget target;
+    std::string subcommand;
+    Tcl_Obj *resultObj;
+    Tcl_WideInt address;
+    unsigned char *array;
+    int array_length;
     int length;
-    uint16_t sizeTransferred;
+    int mode;
+    int erase;
+    bool diff;
+    bool cache;
+    uint64 written;
+    uint64 skipped;
+    int elided;
+    char jedec_id[8];
 
-    if (objc!=3)
+    if (ParseReadTarget(interp, &objc, objv, &target) != TCL_OK)
     {
-        printf("Error: i2c_master_read <slave> <length>.\n");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &slave) != TCL_OK)
+    if (objc < 2)
     {
-        printf("Error: <slave> should be a int number.\n");
+        printf("Error: flash id|sfdp|read|dump|erase|program|program_file|verify|interleave [args].\n");
         return TCL_ERROR;
     }
-    debug("Debug: slave = %d\n", slave);
+    subcommand = Tcl_GetString(objv[1]);
 
-    if (Tcl_GetIntFromObj(interp, objv[2], &length) != TCL_OK)
+    if (subcommand=="id")
     {
-        printf("Error: <length> should be a int number.\n");
-        return TCL_ERROR;
-    }
-    debug("Debug: length = %d\n", slave);
+        if (objc != 2)
+        {
+            printf("Error: flash id accepts no parameter.\n");
+            return TCL_ERROR;
+        }
 
-    for(i=0; i<8192; i++)
-    {
-        Config.rx_buffer[i] = 0x0;
-    }
+        if( (FlushPendingWrite(adapter) != TCL_OK) || (FlashProbe(adapter, false) != TCL_OK) )
+        {
+            return TCL_ERROR;
+        }
 
-    ftStatus = FT4222_I2CMaster_Read(ftHandle, (uint16)slave, Config.rx_buffer, (uint16)length, &sizeTransferred);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
-    {
-        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
-        return TCL_ERROR;
+        snprintf(jedec_id, sizeof(jedec_id), "%06x", adapter->flash.jedec_id);
+        resultObj = Tcl_NewListObj(0, NULL);
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("jedec_id", -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(jedec_id, -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("size", -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(adapter->flash.size));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("address_bytes", -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(adapter->flash.address_bytes));
+        Tcl_SetObjResult(interp, resultObj);
+        return TCL_OK;
     }
-    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
+
+    if (subcommand=="sfdp")
     {
-        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
-        return TCL_ERROR;
+        if ( (objc > 3) || ((objc == 3) && (strcmp(Tcl_GetString(objv[2]), "-reread") != 0)) )
+        {
+            printf("Error: flash sfdp [-reread].\n");
+            return TCL_ERROR;
+        }
+
+        if( (FlushPendingWrite(adapter) != TCL_OK) || (FlashProbe(adapter, objc==3) != TCL_OK) )
+        {
+            return TCL_ERROR;
+        }
+
+        Tcl_SetObjResult(interp, FlashConfigObj(&adapter->flash));
+        return TCL_OK;
     }
-    else if(ftStatus==FT4222_INVALID_POINTER)
+
+    if ( (objc < 4) || (Tcl_GetWideIntFromObj(interp, objv[2], &address) != TCL_OK) || (address < 0) || (address > 0xffffffffLL) )
     {
-        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
+        printf("Error: flash %s <address> ..., <address> should be a 32-bit unsigned number.\n", subcommand.c_str());
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_INVALID_PARAMETER)
+
+    if (subcommand=="interleave")
     {
-        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_INVALID_PARAMETER.\n", ftStatus);
-        return TCL_ERROR;
+        return FlashInterleaveCommand(adapter, interp, (uint32)address, objc, objv);
     }
-    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+
+    if (subcommand=="dump")
     {
-        printf("Error: FT4222_I2CMaster_Read returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
-        return TCL_ERROR;
+        return FlashDumpCommand(adapter, interp, (uint32)address, objc, objv);
     }
-    else if(ftStatus!=FT_OK)
+
+    if (subcommand=="program_file")
     {
-        printf("Error: FT4222_I2CMaster_Read returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        return FlashProgramFileCommand(adapter, interp, (uint32)address, objc, objv);
     }
 
-    if(sizeTransferred != length)
+    if ( (subcommand=="read") || (subcommand=="erase") )
     {
-        printf("Error: FT4222_I2CMaster_Read is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
-        return TCL_ERROR;
+        mode = FLASH_READ_AUTO;
+        erase = FLASH_ERASE_RANGE;
+        if ( (subcommand=="erase") && (objc == 5) && (strcmp(Tcl_GetString(objv[4]), "-chip") == 0) )
+        {
+            erase = FLASH_ERASE_CHIP;
+            objc--;
+        }
+
+        if ( (subcommand=="read") && (objc == 6) && (strcmp(Tcl_GetString(objv[4]), "-mode") == 0) )
+        {
+            if (Tcl_GetIndexFromObj(NULL, objv[5], FlashReadModeNames, "mode", 0, &mode) != TCL_OK)
+            {
+                printf("Error: -mode should be auto/read/fast/dual/dual_io/quad/quad_io.\n");
+                return TCL_ERROR;
+            }
+            objc -= 2;
+        }
+
+        if (objc != 4)
+        {
+            printf("Error: flash %s <address> <length>%s.\n", subcommand.c_str(), (subcommand=="read") ? " [-mode <mode>]" : " [-chip]");
+            return TCL_ERROR;
+        }
+
+        if ( (Tcl_GetIntFromObj(interp, objv[3], &length) != TCL_OK) || (length < 0) )
+        {
+            printf("Error: <length> should be a non-negative int number.\n");
+            return TCL_ERROR;
+        }
+
+        if (subcommand=="erase")
+        {
+            if (FlashErase(adapter, (uint32)address, length, erase==FLASH_ERASE_CHIP) != TCL_OK)
+            {
+                return TCL_ERROR;
+            }
+            debug("Info: flash erase 0x%x %d, done.\n", (uint32)address, length);
+            return TCL_OK;
+        }
+
+        array = NewReadResult(interp, &target, &resultObj, length);
+        if (array == NULL)
+        {
+            return TCL_ERROR;
+        }
+        if (FlashRead(adapter, (uint32)address, array, length, mode) != TCL_OK)
+        {
+            FreeReadResult(resultObj);
+            return TCL_ERROR;
+        }
+        debug("Info: flash read 0x%x %d, done.\n", (uint32)address, length);
+        return SetReadResult(interp, &target, resultObj, length);
     }
 
-    debug("Debug: rx_buffer:\n");
-    for(i=0; i<length; i++)
+    if ( (subcommand=="program") || (subcommand=="verify") )
     {
-        debug(" %02x", Config.rx_buffer[i]);
-    }
-    debug("\n");
+        erase = FLASH_ERASE_RANGE;
+        diff = false;
+        cache = true;
+        mode = FLASH_PROGRAM_AUTO;
+        while ( (subcommand=="program") && (objc > 4) )
+        {
+            if (strcmp(Tcl_GetString(objv[objc-1]), "-noerase") == 0)
+            {
+                erase = FLASH_ERASE_NONE;
+                objc--;
+            }
+            else if (strcmp(Tcl_GetString(objv[objc-1]), "-chip") == 0)
+            {
+                erase = FLASH_ERASE_CHIP;
+                objc--;
+            }
+            else if (strcmp(Tcl_GetString(objv[objc-1]), "-diff") == 0)
+            {
+                diff = true;
+                objc--;
+            }
+            else if (strcmp(Tcl_GetString(objv[objc-1]), "-nocache") == 0)
+            {
+                cache = false;
+                objc--;
+            }
+            else if ( (objc > 5) && (strcmp(Tcl_GetString(objv[objc-2]), "-mode") == 0) )
+            {
+                if (Tcl_GetIndexFromObj(NULL, objv[objc-1], FlashProgramModeNames, "mode", 0, &mode) != TCL_OK)
+                {
+                    printf("Error: -mode should be auto/single/quad.\n");
+                    return TCL_ERROR;
+                }
+                objc -= 2;
+            }
+            else
+            {
+                break;
+            }
+        }
 
-    Tcl_Obj *byteArrayObj = Tcl_NewByteArrayObj(Config.rx_buffer, length);
-    Tcl_SetObjResult(interp, byteArrayObj);
+        if (objc != 4)
+        {
+            printf("Error: flash %s <address> <write_buffer>%s.\n", subcommand.c_str(), (subcommand=="program") ? " [-noerase|-chip|-diff [-nocache]] [-mode <mode>]" : "");
+            return TCL_ERROR;
+        }
 
-    debug("Info: i2c_master_read, done.\n");
-    return TCL_OK;
+        array = GetWriteBuffer(objv[3], &array_length, adapter->config.gather_buffer);
+        if (subcommand=="program")
+        {
+            if (diff)
+            {
+                if (FlashProgramDiff(adapter, (uint32)address, array, array_length, mode, cache, &written, &skipped, &elided) != TCL_OK)
+                {
+                    return TCL_ERROR;
+                }
+                debug("Info: flash program 0x%x %d, %llu bytes written, %llu skipped, %d blank page(s) elided.\n", (uint32)address, array_length,
+                      (unsigned long long)written, (unsigned long long)skipped, elided);
+            }
+            else
+            {
+                if (FlashProgram(adapter, (uint32)address, array, array_length, erase, mode, &elided) != TCL_OK)
+                {
+                    return TCL_ERROR;
+                }
+                debug("Info: flash program 0x%x %d, %d blank page(s) elided.\n", (uint32)address, array_length, elided);
+            }
+
+            resultObj = Tcl_NewDictObj();
+            if (diff)
+            {
+                Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("written", -1), Tcl_NewWideIntObj((Tcl_WideInt)written));
+                Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("skipped", -1), Tcl_NewWideIntObj((Tcl_WideInt)skipped));
+            }
+            Tcl_DictObjPut(interp, resultObj, Tcl_NewStringObj("elided", -1), Tcl_NewIntObj(elided));
+            Tcl_SetObjResult(interp, resultObj);
+            return TCL_OK;
+        }
+        else
+        {
+            if (FlashVerify(adapter, (uint32)address, array, array_length) != TCL_OK)
+            {
+                return TCL_ERROR;
+            }
+        }
+        debug("Info: flash %s 0x%x %d, done.\n", subcommand.c_str(), (uint32)address, array_length);
+        return TCL_OK;
+    }
+
+    printf("Error: flash, unknown subcommand %s.\n", subcommand.c_str());
+    return TCL_ERROR;
 }
 
-int do_i2c_master_write(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+// the flash commands switch lines as needed, then back to the lines set by the script
+int do_flash(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    int i;
-    int slave;
-    int length;
-    uint16_t sizeTransferred;
-    unsigned char* objv1_array;
-    int array_length;
+    Adapter *adapter = GetAdapter(clientData);
+    int lines = adapter->config.lines;
+    int code;
 
-    if (objc!=4)
+    code = FlashCommand(adapter, interp, objc, objv);
+    if( (lines!=0) && (FlashSetLines(adapter, lines)!=TCL_OK) )
     {
-        printf("Error: i2c_master_write <slave> <write_buffer> <length>.\n");
         return TCL_ERROR;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &slave) != TCL_OK)
-    {
-        printf("Error: <slave> should be a int number.\n");
-        return TCL_ERROR;
-    }
-    debug("Debug: slave = %d\n", slave);
+    return code;
+}
+
+//
+// adapter command
+//
+// adapter_open returns the name of a command owning the opened adapter,
+// which runs any of the commands below on it, e.g.
+//
+//   set a [adapter_open 0]
+//   $a spi_master_single_read 256
+//   $a close
+//
+// The adapter_ prefix of a command can be left out.
+//
+struct AdapterCommand
+{
+    const char* name;
+    Tcl_ObjCmdProc* proc;
+};
 
-    objv1_array = Tcl_GetByteArrayFromObj(objv[2], &array_length);
+const AdapterCommand AdapterCommands[] =
+{
+    {"adapter_close",                do_adapter_close},
+    {"adapter_uninitialize",         do_adapter_uninitialize},
+    {"adapter_frequency",            do_adapter_frequency},
+    {"adapter_get_version",          do_adapter_get_version},
+    {"adapter_chip_reset",           do_adapter_chip_reset},
+    {"spi_reset_transaction",        do_spi_reset_transaction},
+    {"spi_reset",                    do_spi_reset},
+    {"spi_set_drive_strength",       do_spi_set_drive_strength},
+    {"spi_master_init",              do_spi_master_init},
+    {"spi_master_set_lines",         do_spi_master_set_lines},
+    {"spi_master_set_mode",          do_spi_master_set_mode},
+    {"spi_master_coalesce",          do_spi_master_coalesce},
+    {"spi_master_single_write",      do_spi_master_single_write},
+    {"spi_master_single_read",       do_spi_master_single_read},
+    {"spi_master_single_read_write", do_spi_master_single_read_write},
+    {"spi_master_multi_read_write",  do_spi_master_multi_read_write},
+    {"spi_master_transaction",       do_spi_master_transaction},
+    {"i2c_master_init",              do_i2c_master_init},
+    {"i2c_master_read",              do_i2c_master_read},
+    {"i2c_master_write",             do_i2c_master_write},
+    {"i2c_master_read_extension",    do_i2c_master_read_extension},
+    {"i2c_master_write_extension",   do_i2c_master_write_extension},
+    {"i2c_master_get_status",        do_i2c_master_get_status},
+    {"i2c_master_reset",             do_i2c_master_reset},
+    {"i2c_master_reset_bus",         do_i2c_master_reset_bus},
+    {"flash",                        do_flash},
+    {NULL, NULL}
+};
 
-    if (Tcl_GetIntFromObj(interp, objv[3], &length) != TCL_OK)
-    {
-        printf("Error: <length> should be a int number.\n");
-        return TCL_ERROR;
-    }
-    debug("Debug: length = %d\n", slave);
+//
+// worker
+//
+// Every adapter gets its own I/O thread with a job queue, started by the
+// first job queued on it. A command ending with -command <callback> is
+// queued instead of run, returns a job id at once, and when it finishes
+// the callback is called from the event loop with two more arguments:
+// ok or error, and the result of the command. Use vwait or update to let
+// the callbacks run.
+//
+// Tcl objects can't be shared between threads, so the arguments and the
+// result are copied as ObjData, and the worker runs the command in a Tcl
+// interpreter of its own. A command without -command first waits for the
+// jobs queued on the adapter, so the order of transfers is kept.
+//
+struct ObjData
+{
+    enum Type { STRING, BYTES, LIST, MAPPED, GATHER } type;
+    std::string data;
+    std::vector <ObjData> elements;
+    MappedRange range;
+};
 
-    for(i=0; i<8192; i++)
-    {
-        Config.tx_buffer[i] = 0x0;
-    }
+void ExportObj(Tcl_Obj *obj, ObjData *objData)
+{
+    static const Tcl_ObjType *byteArrayType = Tcl_GetObjType("bytearray");
+    static const Tcl_ObjType *listType = Tcl_GetObjType("list");
+    unsigned char *bytes;
+    char *string;
+    Tcl_Obj **elements;
+    int length;
+    int i;
 
-    for(i=0; i<length; i++)
+    if(GetMappedRange(obj)!=NULL)
     {
-        Config.tx_buffer[i] = static_cast<unsigned char>(objv1_array[i]);
+        // the mapping is shared, not copied
+        objData->type = ObjData::MAPPED;
+        objData->range = *GetMappedRange(obj);
     }
-
-    debug("Debug: tx_buffer:\n");
-    for(i=0; i<length; i++)
+    else if( (obj->typePtr!=NULL) && (obj->typePtr==byteArrayType) )
     {
-        debug(" %02x", Config.tx_buffer[i]);
+        bytes = Tcl_GetByteArrayFromObj(obj, &length);
+        objData->type = ObjData::BYTES;
+        objData->data.assign((const char*)bytes, length);
     }
-    debug("\n");
-
-    ftStatus = FT4222_I2CMaster_Write(ftHandle, slave, Config.tx_buffer, (uint16_t)length, &sizeTransferred);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    else if(GetGatherParts(obj)!=NULL)
     {
-        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
-        return TCL_ERROR;
+        objData->type = ObjData::GATHER;
+        objData->elements.resize(GetGatherParts(obj)->size());
+        for(i=0; i<(int)objData->elements.size(); i++)
+        {
+            ExportObj((*GetGatherParts(obj))[i], &objData->elements[i]);
+        }
     }
-    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
+    else if( (obj->typePtr!=NULL) && (obj->typePtr==listType) && (obj->bytes==NULL) &&
+             (Tcl_ListObjGetElements(NULL, obj, &length, &elements)==TCL_OK) )
     {
-        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
-        return TCL_ERROR;
+        // a pure list, with no string of its own, is its elements, so
+        // byte arrays and mapped ranges in it aren't turned into strings
+        objData->type = ObjData::LIST;
+        objData->elements.resize(length);
+        for(i=0; i<length; i++)
+        {
+            ExportObj(elements[i], &objData->elements[i]);
+        }
     }
-    else if(ftStatus==FT4222_INVALID_POINTER)
+    else
     {
-        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
-        return TCL_ERROR;
+        string = Tcl_GetStringFromObj(obj, &length);
+        objData->type = ObjData::STRING;
+        objData->data.assign(string, length);
     }
-    else if(ftStatus==FT4222_INVALID_PARAMETER)
+}
+
+Tcl_Obj* ImportObj(const ObjData &objData)
+{
+    std::vector <Tcl_Obj*> parts;
+    Tcl_Obj *obj;
+    size_t i;
+
+    switch(objData.type)
+    {
+    case ObjData::BYTES:
+        return Tcl_NewByteArrayObj((const unsigned char*)objData.data.data(), objData.data.size());
+    case ObjData::MAPPED:
+        return NewMappedRangeObj(objData.range);
+    case ObjData::GATHER:
+        for(i=0; i<objData.elements.size(); i++)
+        {
+            parts.push_back(ImportObj(objData.elements[i]));
+        }
+        return NewGatherObj(parts);
+    case ObjData::LIST:
+        obj = Tcl_NewListObj(0, NULL);
+        for(i=0; i<objData.elements.size(); i++)
+        {
+            Tcl_ListObjAppendElement(NULL, obj, ImportObj(objData.elements[i]));
+        }
+        return obj;
+    default:
+        return Tcl_NewStringObj(objData.data.data(), objData.data.size());
+    }
+}
+
+//
+// scheduler
+//
+// Jobs are queued on the worker of an adapter, or, with job_submit
+// -adapter any, on the least loaded one and left unpinned. A worker with
+// an empty queue steals unpinned jobs from the back of the longest other
+// queue, so no adapter sits idle while another has a backlog. All the
+// queues share one lock, which is only held to move jobs around.
+//
+struct Job
+{
+    int id;
+    bool pinned;
+    std::function<int(Adapter*, Tcl_Interp*, ObjData*)> run;
+    int code;
+    ObjData result;
+    Tcl_Interp *interp;
+    std::string callback;
+    Tcl_ThreadId origin;
+};
+
+struct JobEvent
+{
+    Tcl_Event header;
+    Job *job;
+};
+
+struct Worker
+{
+    Adapter *adapter;
+    std::thread thread;
+    std::deque <Job*> queue;
+    bool busy;
+    bool stop;
+    std::string procs;
+    std::chrono::steady_clock::time_point start;
+    double busy_seconds;
+    int done;
+    int stolen;
+};
+
+std::mutex SchedulerLock;
+std::condition_variable SchedulerCond;
+std::vector <Worker*> Workers;
+int JobCounter = 0;
+
+// runs the callback of a finished job, in the thread that queued it
+int JobEventProc(Tcl_Event *evPtr, int flags)
+{
+    Job *job = ((JobEvent*)evPtr)->job;
+    Tcl_Interp *interp = job->interp;
+    Tcl_Obj *script;
+    int code;
+
+    if(!Tcl_InterpDeleted(interp))
+    {
+        script = Tcl_NewStringObj(job->callback.data(), job->callback.size());
+        Tcl_IncrRefCount(script);
+        Tcl_ListObjAppendElement(NULL, script, Tcl_NewStringObj((job->code==TCL_OK) ? "ok" : "error", -1));
+        Tcl_ListObjAppendElement(NULL, script, ImportObj(job->result));
+        code = Tcl_EvalObjEx(interp, script, TCL_EVAL_GLOBAL);
+        if(code!=TCL_OK)
+        {
+            Tcl_BackgroundException(interp, code);
+        }
+        Tcl_DecrRefCount(script);
+    }
+
+    Tcl_Release(interp);
+    delete job;
+    return 1;
+}
+
+// called with SchedulerLock held
+Job* NextJob(Worker *worker)
+{
+    Worker *victim = NULL;
+    Job *job;
+    size_t i;
+
+    if(!worker->queue.empty())
     {
-        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_INVALID_PARAMETER.\n", ftStatus);
-        return TCL_ERROR;
+        job = worker->queue.front();
+        worker->queue.pop_front();
+        return job;
     }
-    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+
+    if(worker->stop)
     {
-        printf("Error: FT4222_I2CMaster_Write returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
-        return TCL_ERROR;
+        return NULL;
     }
-    else if(ftStatus!=FT_OK)
+
+    for(i=0; i<Workers.size(); i++)
     {
-        printf("Error: FT4222_I2CMaster_Write returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        if( (Workers[i]!=worker) && ((victim==NULL) || (Workers[i]->queue.size() > victim->queue.size())) )
+        {
+            victim = Workers[i];
+        }
     }
 
-    if((int)sizeTransferred != length)
+    if(victim!=NULL)
     {
-        printf("Error: FT4222_I2CMaster_Write is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
-        return TCL_ERROR;
+        for(i=victim->queue.size(); i>0; i--)
+        {
+            job = victim->queue[i-1];
+            if(!job->pinned)
+            {
+                victim->queue.erase(victim->queue.begin()+(i-1));
+                worker->stolen++;
+                return job;
+            }
+        }
     }
 
-    debug("Info: i2c_master_write, done.\n");
-    return TCL_OK;
+    return NULL;
 }
 
-int do_i2c_master_read_extension(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+void WorkerMain(Worker *worker)
 {
+    Adapter *adapter = worker->adapter;
+    std::chrono::steady_clock::time_point start;
+    Tcl_Interp *interp;
+    JobEvent *event;
+    Job *job = NULL;
+    double seconds;
     int i;
-    int slave;
-    int length;
-    uint16_t sizeTransferred;
-    std::string flag_string;
-    uint8 flag;
 
-    if (objc!=4)
+    // the commands of the worker interpreter work on its adapter
+    interp = Tcl_CreateInterp();
+    Tcl_Init(interp);
+    Tcl_CreateObjCommand(interp, "usbio::mmap", do_mmap, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "usbio::gather", do_gather, NULL, NULL);
+    for(i=0; AdapterCommands[i].name!=NULL; i++)
     {
-        printf("Error: i2c_master_read_extension <slave> <length> <flag>.\n");
-        return TCL_ERROR;
+        if(AdapterCommands[i].proc!=do_adapter_close)
+        {
+            Tcl_CreateObjCommand(interp, AdapterCommands[i].name, AdapterCommands[i].proc, (ClientData)adapter, NULL);
+        }
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &slave) != TCL_OK)
+    std::unique_lock <std::mutex> lock(SchedulerLock);
+    while(true)
     {
-        printf("Error: <slave> should be a int number.\n");
-        return TCL_ERROR;
+        SchedulerCond.wait(lock, [worker, &job]{ return ((job=NextJob(worker))!=NULL) || worker->stop; });
+        if(job==NULL)
+        {
+            break;
+        }
+        worker->busy = true;
+        lock.unlock();
+
+        start = std::chrono::steady_clock::now();
+        job->code = job->run(adapter, interp, &job->result);
+        Tcl_ResetResult(interp);
+
+        seconds = std::chrono::duration <double> (std::chrono::steady_clock::now()-start).count();
+
+        // the callback is queued before the job counts as done, so it's
+        // there for update after job_wait
+        if(job->callback.empty())
+        {
+            delete job;
+        }
+        else
+        {
+            event = (JobEvent*)ckalloc(sizeof(JobEvent));
+            event->header.proc = JobEventProc;
+            event->job = job;
+            Tcl_ThreadQueueEvent(job->origin, (Tcl_Event*)event, TCL_QUEUE_TAIL);
+            Tcl_ThreadAlert(job->origin);
+        }
+
+        lock.lock();
+        worker->busy_seconds += seconds;
+        worker->done++;
+        worker->busy = false;
+        SchedulerCond.notify_all();
+    }
+    lock.unlock();
+
+    Tcl_DeleteInterp(interp);
+    Tcl_FinalizeThread();
+}
+
+Worker* StartWorker(Adapter *adapter)
+{
+    Worker *worker;
+
+    if(adapter->worker==NULL)
+    {
+        worker = new Worker();
+        worker->adapter = adapter;
+        worker->busy = false;
+        worker->stop = false;
+        worker->start = std::chrono::steady_clock::now();
+        worker->busy_seconds = 0;
+        worker->done = 0;
+        worker->stolen = 0;
+        {
+            std::lock_guard <std::mutex> lock(SchedulerLock);
+            Workers.push_back(worker);
+        }
+        worker->thread = std::thread(WorkerMain, worker);
+        adapter->worker = worker;
     }
-    debug("Debug: slave = %d\n", slave);
 
-    if (Tcl_GetIntFromObj(interp, objv[2], &length) != TCL_OK)
-    {
-        printf("Error: <length> should be a int number.\n");
-        return TCL_ERROR;
-    }
-    debug("Debug: length = %d\n", slave);
+    return adapter->worker;
+}
 
-    flag_string = Tcl_GetString(objv[3]);
-    if(flag_string=="START")
-        flag = 0x2;
-    else if(flag_string=="Repeated_START")
-        flag = 0x3;
-    else if(flag_string=="STOP")
-        flag = 0x4;
-    else if(flag_string=="START_AND_STOP")
-        flag = 0x6;
-    else
-    {
-        printf("Error: flag should be <START|Repeated_START|STOP|START_AND_STOP>");
-        return TCL_ERROR;
-    }
+// queues the job on the adapter, or on the least loaded open adapter if
+// adapter is NULL, which any other adapter may then steal
+int QueueJob(Adapter *adapter, Job *job)
+{
+    Worker *worker = NULL;
+    size_t i;
 
-    for(i=0; i<8192; i++)
+    // the interpreter is kept until the callback event is done with it,
+    // even if it's deleted before
+    if(!job->callback.empty())
     {
-        Config.rx_buffer[i] = 0x0;
+        Tcl_Preserve(job->interp);
     }
 
-    ftStatus = FT4222_I2CMaster_ReadEx(ftHandle, (uint16)slave, flag, Config.rx_buffer, (uint16)length, &sizeTransferred);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    job->pinned = (adapter!=NULL);
+    if(adapter!=NULL)
     {
-        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
-        return TCL_ERROR;
+        worker = StartWorker(adapter);
     }
-    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
+    else
     {
-        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
-        return TCL_ERROR;
+        for(i=0; i<OpenAdapters.size(); i++)
+        {
+            StartWorker(OpenAdapters[i]);
+        }
     }
-    else if(ftStatus==FT4222_INVALID_POINTER)
+
+    std::lock_guard <std::mutex> lock(SchedulerLock);
+    for(i=0; (adapter==NULL) && (i<OpenAdapters.size()); i++)
     {
-        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
-        return TCL_ERROR;
+        Worker *candidate = OpenAdapters[i]->worker;
+        if( (worker==NULL) || (candidate->queue.size()+candidate->busy < worker->queue.size()+worker->busy) )
+        {
+            worker = candidate;
+        }
     }
-    else if(ftStatus==FT4222_INVALID_PARAMETER)
+
+    job->id = ++JobCounter;
+    worker->queue.push_back(job);
+    SchedulerCond.notify_all();
+
+    return job->id;
+}
+
+// waits until all jobs queued on the adapter are done
+void WaitWorker(Adapter *adapter)
+{
+    Worker *worker = adapter->worker;
+
+    if(worker==NULL)
     {
-        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_INVALID_PARAMETER.\n", ftStatus);
-        return TCL_ERROR;
+        return;
     }
-    else if(ftStatus==FT4222_FAILED_TO_READ_DEVICE)
+
+    std::unique_lock <std::mutex> lock(SchedulerLock);
+    SchedulerCond.wait(lock, [worker]{ return worker->queue.empty() && !worker->busy; });
+}
+
+// finishes the jobs queued on the adapter, then ends the thread
+void StopWorker(Adapter *adapter)
+{
+    Worker *worker = adapter->worker;
+
+    if(worker==NULL)
     {
-        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), FT4222_FAILED_TO_READ_DEVICE.\n", ftStatus);
-        return TCL_ERROR;
+        return;
     }
-    else if(ftStatus!=FT_OK)
+
     {
-        printf("Error: FT4222_I2CMaster_ReadEx returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        std::lock_guard <std::mutex> lock(SchedulerLock);
+        worker->stop = true;
+        SchedulerCond.notify_all();
     }
+    worker->thread.join();
 
-    if(sizeTransferred != length)
     {
-        printf("Error: FT4222_I2CMaster_ReadEx is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
-        return TCL_ERROR;
+        std::lock_guard <std::mutex> lock(SchedulerLock);
+        Workers.erase(std::remove(Workers.begin(), Workers.end(), worker), Workers.end());
     }
+    delete worker;
+    adapter->worker = NULL;
+}
 
-    debug("Debug: rx_buffer:\n");
-    for(i=0; i<length; i++)
+// a job evaluating the command in the worker interpreter, after loading
+// the procs of the submitting interpreter if it needs them
+std::function<int(Adapter*, Tcl_Interp*, ObjData*)> EvalJob(const std::vector <ObjData> &args, std::shared_ptr <std::string> procs)
+{
+    return [args, procs](Adapter *adapter, Tcl_Interp *interp, ObjData *result) -> int
     {
-        debug(" %02x", Config.rx_buffer[i]);
-    }
-    debug("\n");
+        std::vector <Tcl_Obj*> objs;
+        size_t i;
+        int code = TCL_OK;
 
-    Tcl_Obj *byteArrayObj = Tcl_NewByteArrayObj(Config.rx_buffer, length);
-    Tcl_SetObjResult(interp, byteArrayObj);
+        if( (procs!=NULL) && (adapter->worker->procs!=*procs) )
+        {
+            code = Tcl_Eval(interp, procs->c_str());
+            adapter->worker->procs = (code==TCL_OK) ? *procs : "";
+        }
 
-    debug("Info: i2c_master_read_extension, done.\n");
-    return TCL_OK;
+        if(code==TCL_OK)
+        {
+            for(i=0; i<args.size(); i++)
+            {
+                objs.push_back(ImportObj(args[i]));
+                Tcl_IncrRefCount(objs[i]);
+            }
+            code = Tcl_EvalObjv(interp, objs.size(), objs.data(), TCL_EVAL_GLOBAL);
+            for(i=0; i<objs.size(); i++)
+            {
+                Tcl_DecrRefCount(objs[i]);
+            }
+        }
+
+        ExportObj(Tcl_GetObjResult(interp), result);
+        return code;
+    };
 }
 
-int do_i2c_master_write_extension(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+// the adapter of an adapter command, or NULL
+Adapter* FindAdapter(Tcl_Interp *interp, Tcl_Obj *obj)
 {
-    int i;
-    int slave;
-    int length;
-    uint16_t sizeTransferred;
-    unsigned char* objv1_array;
-    int array_length;
-    std::string flag_string;
-    uint8 flag;
+    Tcl_CmdInfo info;
 
-    if (objc!=5)
+    if( (Tcl_GetCommandInfo(interp, Tcl_GetString(obj), &info)==0) || (info.objProc!=do_adapter_command) )
     {
-        printf("Error: i2c_master_write_extension <slave> <write_buffer> <length> <flag>.\n");
-        return TCL_ERROR;
+        printf("Error: %s is not an adapter command.\n", Tcl_GetString(obj));
+        return NULL;
     }
 
-    if (Tcl_GetIntFromObj(interp, objv[1], &slave) != TCL_OK)
+    return (Adapter*)info.objClientData;
+}
+
+const AdapterCommand* FindAdapterCommand(const std::string &command)
+{
+    int i;
+
+    for(i=0; AdapterCommands[i].name!=NULL; i++)
     {
-        printf("Error: <slave> should be a int number.\n");
-        return TCL_ERROR;
+        if( (command==AdapterCommands[i].name) || ("adapter_"+command==AdapterCommands[i].name) )
+        {
+            return &AdapterCommands[i];
+        }
     }
-    debug("Debug: slave = %d\n", slave);
 
-    objv1_array = Tcl_GetByteArrayFromObj(objv[2], &array_length);
+    return NULL;
+}
 
-    if (Tcl_GetIntFromObj(interp, objv[3], &length) != TCL_OK)
+int RunAdapterCommand(Adapter *adapter, const AdapterCommand *command, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    std::vector <ObjData> args;
+    Job *job;
+    int id;
+    int i;
+
+    if( (objc<3) || (strcmp(Tcl_GetString(objv[objc-2]), "-command")!=0) )
     {
-        printf("Error: <length> should be a int number.\n");
-        return TCL_ERROR;
+        WaitWorker(adapter);
+        return command->proc((ClientData)adapter, interp, objc, objv);
     }
-    debug("Debug: length = %d\n", slave);
 
-    flag_string = Tcl_GetString(objv[4]);
-    if(flag_string=="START")
-        flag = 0x2;
-    else if(flag_string=="Repeated_START")
-        flag = 0x3;
-    else if(flag_string=="STOP")
-        flag = 0x4;
-    else if(flag_string=="START_AND_STOP")
-        flag = 0x6;
-    else
+    if(command->proc==do_adapter_close)
     {
-        printf("Error: flag should be <START|Repeated_START|STOP|START_AND_STOP>");
+        printf("Error: %s can't be used with -command.\n", command->name);
         return TCL_ERROR;
     }
 
-    for(i=0; i<8192; i++)
+    for(i=objc-6; i<=objc-4; i+=2)
     {
-        Config.tx_buffer[i] = 0x0;
+        if( (i>0) && (strcmp(Tcl_GetString(objv[i]), "-into")==0) )
+        {
+            printf("Error: -into can't be used with -command.\n");
+            return TCL_ERROR;
+        }
     }
 
-    for(i=0; i<length; i++)
+    args.resize(objc-2);
+    args[0].type = ObjData::STRING;
+    args[0].data = command->name;
+    for(i=1; i<objc-2; i++)
     {
-        Config.tx_buffer[i] = static_cast<unsigned char>(objv1_array[i]);
+        ExportObj(objv[i], &args[i]);
     }
 
-    debug("Debug: tx_buffer:\n");
-    for(i=0; i<length; i++)
+    job = new Job();
+    job->interp = interp;
+    job->callback = Tcl_GetString(objv[objc-1]);
+    job->origin = Tcl_GetCurrentThread();
+    job->run = EvalJob(args, NULL);
+
+    id = QueueJob(adapter, job);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(id));
+    debug("Info: %s queued on %s as job %d.\n", command->name, adapter->name.c_str(), id);
+
+    return TCL_OK;
+}
+
+// the procs of the interpreter, as a script defining them again
+const char *ProcsScript =
+    "apply {{} {\n"
+    "    set script {}\n"
+    "    foreach name [info procs ::*] {\n"
+    "        set arguments {}\n"
+    "        foreach arg [info args $name] {\n"
+    "            if {[info default $name $arg value]} { lappend arguments [list $arg $value] } else { lappend arguments $arg }\n"
+    "        }\n"
+    "        append script [list proc $name $arguments [info body $name]] \\n\n"
+    "    }\n"
+    "    return $script\n"
+    "}}";
+
+int do_job_submit(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    std::shared_ptr <std::string> procs;
+    std::vector <ObjData> args;
+    const AdapterCommand *command;
+    Adapter *adapter = NULL;
+    std::string callback;
+    std::string option;
+    std::string name;
+    Job *job;
+    int code;
+    int id;
+    int i;
+
+    for(i=1; i+1<objc; i+=2)
     {
-        debug(" %02x", Config.tx_buffer[i]);
+        option = Tcl_GetString(objv[i]);
+        if(option=="-adapter")
+        {
+            adapter = (strcmp(Tcl_GetString(objv[i+1]), "any")==0) ? NULL : FindAdapter(interp, objv[i+1]);
+            if( (adapter==NULL) && (strcmp(Tcl_GetString(objv[i+1]), "any")!=0) )
+            {
+                return TCL_ERROR;
+            }
+        }
+        else if(option=="-command")
+        {
+            callback = Tcl_GetString(objv[i+1]);
+        }
+        else
+        {
+            break;
+        }
     }
-    debug("\n");
 
-    ftStatus = FT4222_I2CMaster_WriteEx(ftHandle, slave, flag, Config.tx_buffer, (uint16_t)length, &sizeTransferred);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    if (i >= objc)
     {
-        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
+        printf("Error: job_submit [-adapter <adapter>|any] [-command <callback>] <command> [arg ...].\n");
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
+
+    if( (adapter==NULL) && OpenAdapters.empty() )
     {
-        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
+        printf("Error: job_submit, no adapter is open.\n");
         return TCL_ERROR;
     }
-    else if(ftStatus==FT4222_INVALID_POINTER)
+
+    // an adapter command runs as it is, anything else must be a proc,
+    // which is run with the procs of this interpreter
+    command = FindAdapterCommand(Tcl_GetString(objv[i]));
+    if(command!=NULL)
     {
-        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_INVALID_POINTER.\n", ftStatus);
-        return TCL_ERROR;
+        if(command->proc==do_adapter_close)
+        {
+            printf("Error: %s can't be submitted as a job.\n", command->name);
+            return TCL_ERROR;
+        }
     }
-    else if(ftStatus==FT4222_INVALID_PARAMETER)
+    else
     {
-        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_INVALID_PARAMETER.\n", ftStatus);
-        return TCL_ERROR;
+        Tcl_Obj *info[3] = { Tcl_NewStringObj("info", -1), Tcl_NewStringObj("procs", -1), objv[i] };
+        for(int j=0; j<3; j++) Tcl_IncrRefCount(info[j]);
+        code = Tcl_EvalObjv(interp, 3, info, 0);
+        for(int j=0; j<3; j++) Tcl_DecrRefCount(info[j]);
+        if( (code!=TCL_OK) || (Tcl_GetCharLength(Tcl_GetObjResult(interp))==0) )
+        {
+            printf("Error: %s is neither an adapter command nor a proc.\n", Tcl_GetString(objv[i]));
+            return TCL_ERROR;
+        }
+
+        // only the procs of the global namespace are sent to the worker
+        name = Tcl_GetString(objv[i]);
+        if(name.find("::", (name.compare(0, 2, "::")==0) ? 2 : 0)!=std::string::npos)
+        {
+            printf("Error: %s is in a namespace, only global procs can be submitted as a job.\n", name.c_str());
+            Tcl_ResetResult(interp);
+            return TCL_ERROR;
+        }
+
+        if(Tcl_Eval(interp, ProcsScript)!=TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+        procs = std::make_shared <std::string>(Tcl_GetStringResult(interp));
+        Tcl_ResetResult(interp);
     }
-    else if(ftStatus==FT4222_FAILED_TO_WRITE_DEVICE)
+
+    args.resize(objc-i);
+    for(int j=0; j<objc-i; j++)
     {
-        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), FT4222_FAILED_TO_WRITE_DEVICE.\n", ftStatus);
-        return TCL_ERROR;
+        ExportObj(objv[i+j], &args[j]);
     }
-    else if(ftStatus!=FT_OK)
+    if(command!=NULL)
     {
-        printf("Error: FT4222_I2CMaster_WriteEx returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        args[0].type = ObjData::STRING;
+        args[0].data = command->name;
     }
 
-    if((int)sizeTransferred != length)
+    job = new Job();
+    job->interp = interp;
+    job->callback = callback;
+    job->origin = Tcl_GetCurrentThread();
+    job->run = EvalJob(args, procs);
+
+    id = QueueJob(adapter, job);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(id));
+    debug("Info: job %d submitted to %s.\n", id, (adapter!=NULL) ? adapter->name.c_str() : "any adapter");
+
+    return TCL_OK;
+}
+
+int do_job_wait(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    if (objc != 1)
     {
-        printf("Error: FT4222_I2CMaster_WriteEx is required to transfer %d byte(s), but actually transfer %d byte(s).\n", length, sizeTransferred);
+        printf("Error: job_wait accepts no parameter.\n");
         return TCL_ERROR;
     }
 
-    debug("Info: i2c_master_write_extension, done.\n");
+    std::unique_lock <std::mutex> lock(SchedulerLock);
+    SchedulerCond.wait(lock, []
+    {
+        for(size_t i=0; i<Workers.size(); i++)
+        {
+            if( !Workers[i]->queue.empty() || Workers[i]->busy )
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+
+    debug("Info: job_wait, done.\n");
     return TCL_OK;
 }
 
-int do_i2c_master_get_status(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int do_job_stats(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    uint8 controller_status;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    Tcl_Obj *resultObj;
+    Tcl_Obj *statsObj;
+    Worker *worker;
+    double seconds;
+    int queued = 0;
+    size_t i;
 
     if (objc != 1)
     {
-        printf("Error: i2c_master_get_status accepts no parameter.\n");
+        printf("Error: job_stats accepts no parameter.\n");
         return TCL_ERROR;
     }
 
-    ftStatus = FT4222_I2CMaster_GetStatus(ftHandle, &controller_status);
-    if(ftStatus!=FT4222_OK)
+    resultObj = Tcl_NewListObj(0, NULL);
+    std::lock_guard <std::mutex> lock(SchedulerLock);
+    for(i=0; i<Workers.size(); i++)
     {
-        printf("Error: FT4222_I2CMaster_GetStatus returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        worker = Workers[i];
+        seconds = std::chrono::duration <double> (now-worker->start).count();
+        queued += worker->queue.size();
+
+        statsObj = Tcl_NewListObj(0, NULL);
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("queued", -1));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewIntObj(worker->queue.size()));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("busy", -1));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewIntObj(worker->busy));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("done", -1));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewIntObj(worker->done));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("stolen", -1));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewIntObj(worker->stolen));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("utilisation", -1));
+        Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewDoubleObj((seconds>0) ? worker->busy_seconds/seconds : 0.0));
+
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(worker->adapter->name.c_str(), -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, statsObj);
     }
 
-    Tcl_Obj *intObj = Tcl_NewIntObj((int)controller_status);
-    Tcl_SetObjResult(interp, intObj);
+    statsObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("queued", -1));
+    Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewIntObj(queued));
+    Tcl_ListObjAppendElement(NULL, statsObj, Tcl_NewStringObj("adapters", -1));
+    Tcl_ListObjAppendElement(NULL, statsObj, resultObj);
 
-    debug("Info: i2c_master_get_status, done.\n");
+    Tcl_SetObjResult(interp, statsObj);
     return TCL_OK;
 }
 
-int do_i2c_master_reset(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+int do_adapter_command(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
-    if (objc != 1)
+    Adapter *adapter = (Adapter*)clientData;
+    const AdapterCommand *command;
+
+    if (objc < 2)
     {
-        printf("Error: i2c_master_reset accepts no parameter.\n");
+        printf("Error: %s <command> [args].\n", adapter->name.c_str());
         return TCL_ERROR;
     }
 
-    ftStatus = FT4222_I2CMaster_Reset(ftHandle);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    command = FindAdapterCommand(Tcl_GetString(objv[1]));
+    if(command!=NULL)
     {
-        printf("Error: FT4222_I2CMaster_Reset returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
-        return TCL_ERROR;
+        return RunAdapterCommand(adapter, command, interp, objc-1, objv+1);
     }
-    else if(ftStatus==FT4222_IS_NOT_I2C_MODE)
+
+    printf("Error: %s, unknown command %s.\n", adapter->name.c_str(), Tcl_GetString(objv[1]));
+    return TCL_ERROR;
+}
+
+// the plain commands, run on CurrentAdapter
+int do_current_adapter_command(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    return RunAdapterCommand(CurrentAdapter, (const AdapterCommand*)clientData, interp, objc, objv);
+}
+
+//
+// gang program
+//
+// gang_program <address> <image> [-adapters <list>] [-noverify]
+//
+// Programs the same image to every open adapter, or the adapter commands
+// in <list>, in parallel. The image is copied once into a shared buffer,
+// and an erase/program/verify job is queued on the thread of each adapter,
+// so the total time is about that of the slowest target. Returns a dict of
+// adapter name and ok, or the error of that target.
+//
+struct GangResult
+{
+    Adapter *adapter;
+    int code;
+    double seconds;
+};
+
+int do_gang_program(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    std::shared_ptr <const unsigned char> image;
+    std::shared_ptr < std::vector <unsigned char> > copy;
+    std::vector <Tcl_Obj*> *parts;
+    std::vector <unsigned char> gather;
+    MappedRange *range;
+    std::vector <Adapter*> targets;
+    std::vector <GangResult> results;
+    std::chrono::steady_clock::time_point start;
+    Tcl_Obj **elements;
+    Tcl_Obj *resultObj;
+    unsigned char *array;
+    int array_length;
+    int address;
+    int count;
+    bool verify = true;
+    double seconds;
+    int passed;
+    int i;
+
+    if (objc < 3)
     {
-        printf("Error: FT4222_I2CMaster_Reset returns(%d), FT4222_IS_NOT_I2C_MODE.\n", ftStatus);
+        printf("Error: gang_program <address> <image> [-adapters <list>] [-noverify].\n");
         return TCL_ERROR;
     }
-    else if(ftStatus!=FT_OK)
+
+    if ( (Tcl_GetIntFromObj(interp, objv[1], &address) != TCL_OK) || (address<0) )
     {
-        printf("Error: FT4222_I2CMaster_Reset returns(%d), unknown error.\n", ftStatus);
+        printf("Error: <address> should be a non-negative int number.\n");
         return TCL_ERROR;
     }
 
-    debug("Info: i2c_master_reset, done.\n");
-    return TCL_OK;
-}
+    targets = OpenAdapters;
+    for(i=3; i<objc; i++)
+    {
+        if( (strcmp(Tcl_GetString(objv[i]), "-adapters")==0) && (i+1<objc) )
+        {
+            if(Tcl_ListObjGetElements(interp, objv[++i], &count, &elements)!=TCL_OK)
+            {
+                printf("Error: -adapters should be a list of adapter commands.\n");
+                return TCL_ERROR;
+            }
+
+            targets.clear();
+            for(int j=0; j<count; j++)
+            {
+                Adapter *adapter = FindAdapter(interp, elements[j]);
+                if(adapter==NULL)
+                {
+                    return TCL_ERROR;
+                }
+                targets.push_back(adapter);
+            }
+        }
+        else if(strcmp(Tcl_GetString(objv[i]), "-noverify")==0)
+        {
+            verify = false;
+        }
+        else
+        {
+            printf("Error: unknown option %s.\n", Tcl_GetString(objv[i]));
+            return TCL_ERROR;
+        }
+    }
 
-int do_i2c_master_reset_bus(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
-{
-    if (objc != 1)
+    if(targets.empty())
     {
-        printf("Error: i2c_master_reset_bus accepts no parameter.\n");
+        printf("Error: gang_program, no adapter is open.\n");
         return TCL_ERROR;
     }
 
-    ftStatus = FT4222_I2CMaster_ResetBus(ftHandle);
-    if(ftStatus==FT4222_DEVICE_NOT_OPENED)
+    // the jobs share a mapped image with the mapping, anything else is copied
+    parts = GetGatherParts(objv[2]);
+    range = GetMappedRange( ((parts!=NULL) && (parts->size()==1)) ? (*parts)[0] : objv[2] );
+    if(range!=NULL)
     {
-        printf("Error: FT4222_I2CMaster_ResetBus returns(%d), FT4222_DEVICE_NOT_OPENED.\n", ftStatus);
-        return TCL_ERROR;
+        image = std::shared_ptr <const unsigned char>(range->file, range->file->base+range->offset);
+        array_length = range->length;
     }
-    else if(ftStatus!=FT_OK)
+    else
     {
-        printf("Error: FT4222_I2CMaster_ResetBus returns(%d), unknown error.\n", ftStatus);
-        return TCL_ERROR;
+        array = GetWriteBuffer(objv[2], &array_length, gather);
+        copy = std::make_shared < std::vector <unsigned char> >(array, array+array_length);
+        image = std::shared_ptr <const unsigned char>(copy, copy->data());
+        copy.reset();
     }
 
-    debug("Info: i2c_master_reset_bus, done.\n");
+    start = std::chrono::steady_clock::now();
+    results.resize(targets.size());
+    for(i=0; i<(int)targets.size(); i++)
+    {
+        GangResult *result = &results[i];
+        Job *job = new Job();
+
+        result->adapter = targets[i];
+        job->run = [result, image, array_length, address, verify](Adapter *adapter, Tcl_Interp *interp, ObjData *objData) -> int
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            const unsigned char *data = image.get();
+            int length = array_length;
+            int lines = adapter->config.lines;
+            int elided;
+
+            adapter->error.clear();
+            adapter->flash.probed = false;
+            result->code = FlashProgram(adapter, address, data, length, FLASH_ERASE_RANGE, FLASH_PROGRAM_AUTO, &elided);
+            if( (result->code==TCL_OK) && verify )
+            {
+                result->code = FlashVerify(adapter, address, data, length);
+            }
+            if( (lines!=0) && (FlashSetLines(adapter, lines)!=TCL_OK) )
+            {
+                result->code = TCL_ERROR;
+            }
+            result->seconds = std::chrono::duration <double> (std::chrono::steady_clock::now()-start).count();
+            return result->code;
+        };
+        QueueJob(targets[i], job);
+    }
+    image.reset();
+
+    for(i=0; i<(int)targets.size(); i++)
+    {
+        WaitWorker(targets[i]);
+    }
+    seconds = std::chrono::duration <double> (std::chrono::steady_clock::now()-start).count();
+
+    passed = 0;
+    resultObj = Tcl_NewListObj(0, NULL);
+    for(i=0; i<(int)results.size(); i++)
+    {
+        Adapter *adapter = results[i].adapter;
+
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(adapter->name.c_str(), -1));
+        if(results[i].code==TCL_OK)
+        {
+            Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("ok", -1));
+            passed++;
+        }
+        else
+        {
+            Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(adapter->error.c_str(), -1));
+        }
+        printf("Info: %s, %s in %.3f second(s).\n", adapter->name.c_str(), (results[i].code==TCL_OK) ? "ok" : "failed", results[i].seconds);
+    }
+    printf("Info: gang_program %d byte(s) to %d/%d target(s) in %.3f second(s), %.3f MB/s in total.\n",
+        array_length, passed, (int)results.size(), seconds, (seconds>0) ? (double)array_length*passed/seconds/1000000 : 0.0);
+
+    Tcl_SetObjResult(interp, resultObj);
     return TCL_OK;
 }
 
@@ -1599,29 +7632,16 @@ int main(int argc, char *argv[])
 
     Tcl_CreateObjCommand(interp, "adapter_list", do_adapter_list, NULL, NULL);
     Tcl_CreateObjCommand(interp, "adapter_open", do_adapter_open, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "adapter_close", do_adapter_close, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "adapter_uninitialize", do_adapter_uninitialize, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "adapter_frequency", do_adapter_frequency, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "adapter_get_version", do_adapter_get_version, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "adapter_chip_reset", do_adapter_chip_reset, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_reset_transaction", do_spi_reset_transaction, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_reset", do_spi_reset, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_set_drive_strength", do_spi_set_drive_strength, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_master_init", do_spi_master_init, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_master_set_lines", do_spi_master_set_lines, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_master_set_mode", do_spi_master_set_mode, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_master_single_write", do_spi_master_single_write, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_master_single_read", do_spi_master_single_read, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_master_single_read_write", do_spi_master_single_read_write, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "spi_master_multi_read_write", do_spi_master_multi_read_write, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "i2c_master_init", do_i2c_master_init, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "i2c_master_read", do_i2c_master_read, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "i2c_master_write", do_i2c_master_write, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "i2c_master_read_extension", do_i2c_master_read_extension, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "i2c_master_write_extension", do_i2c_master_write_extension, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "i2c_master_get_status", do_i2c_master_get_status, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "i2c_master_reset", do_i2c_master_reset, NULL, NULL);
-    Tcl_CreateObjCommand(interp, "i2c_master_reset_bus", do_i2c_master_reset_bus, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "gang_program", do_gang_program, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "job_submit", do_job_submit, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "job_wait", do_job_wait, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "job_stats", do_job_stats, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "usbio::mmap", do_mmap, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "usbio::gather", do_gather, NULL, NULL);
+    for(int i=0; AdapterCommands[i].name!=NULL; i++)
+    {
+        Tcl_CreateObjCommand(interp, AdapterCommands[i].name, do_current_adapter_command, (ClientData)&AdapterCommands[i], NULL);
+    }
 
     // --file
     if( a.exist("file") == false )
@@ -1639,6 +7659,12 @@ int main(int argc, char *argv[])
             Tcl_GetVar(interp, "errorInfo", TCL_GLOBAL_ONLY)
         );
     }
+    // no worker is left to queue a callback for the interpreter
+    for(size_t i=0; i<OpenAdapters.size(); i++)
+    {
+        StopWorker(OpenAdapters[i]);
+    }
+    StopWorker(&DefaultAdapter);
     Tcl_DeleteInterp(interp);
     Tcl_Finalize();
 